@@ -0,0 +1,26 @@
+/**
+ * @file atrousfilter.h
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#ifndef ATROUSFILTER_H
+#define ATROUSFILTER_H
+
+#include <vector>
+
+class ATrousFilter
+{
+public:
+    static void run(const std::vector<float> &input, int w, int h,
+                    std::vector<float> &output, bool hdr);
+
+private:
+    static void _pass(const std::vector<float> &src, std::vector<float> &dst,
+                      const float *albedo, const float *normal,
+                      int w, int h, int step, float sigmaC, bool hdr,
+                      int y0, int y1);
+};
+
+#endif // ATROUSFILTER_H
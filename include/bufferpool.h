@@ -0,0 +1,44 @@
+/**
+ * @file bufferpool.h
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <mutex>
+#include <ostream>
+#include <initializer_list>
+
+class BufferPool
+{
+private:
+    BufferPool();
+
+public:
+    static BufferPool *instance();
+    std::vector<float> acquire(size_t len, const char *stage);
+    void release(std::vector<float> &buf);
+    void release(std::initializer_list<std::vector<float> *> bufs);
+    void report(std::ostream &out) const;
+    static size_t peakRss();
+
+private:
+    struct StageStats
+    {
+        size_t allocs = 0;
+        size_t reuses = 0;
+        size_t bytes = 0;
+    };
+    static BufferPool *m_instance;
+    std::vector<std::vector<float>> m_free;
+    std::map<std::string, StageStats> m_stats;
+    mutable std::mutex m_mutex;
+};
+
+#endif // BUFFERPOOL_H
@@ -10,6 +10,7 @@
 
 #include <vector>
 #include <utility>
+#include "imagedenoiser.h"
 
 typedef std::pair<float, float> CurveParam;
 
@@ -20,7 +21,20 @@ public:
                                    const std::vector<float> &noisy,
                                    int w, int h,
                                    const std::vector<float> &var,
-                                   bool useOptiX, bool hdr, bool cleanAux);
+                                   ImageDenoiser::Backend backend,
+                                   bool hdr, bool cleanAux,
+                                   int tries = 1,
+                                   ImageDenoiser::Quality quality
+                                   = ImageDenoiser::High);
+    static std::vector<float> sureTiled(const std::vector<float> &denoised,
+                                        const std::vector<float> &noisy,
+                                        int w, int h,
+                                        const std::vector<float> &var,
+                                        float fraction,
+                                        ImageDenoiser::Backend backend,
+                                        bool hdr, bool cleanAux,
+                                        ImageDenoiser::Quality quality
+                                        = ImageDenoiser::High);
     static int denoisedWeight(float sure, const CurveParam &outs,
                               int minWeight);
     static void blend(const std::vector<float> &img1,
@@ -29,17 +43,43 @@ public:
                       std::vector<float> &blended);
     static std::vector<CurveParam> calcCurves(
             const std::vector<std::vector<float>> &vars, const int *spp,
-            bool useLastTwoPoint = true);
+            bool useLastTwoPoint = true,
+            const std::vector<char> *dirty = nullptr,
+            const std::vector<CurveParam> *prev = nullptr,
+            const std::vector<CurveParam> *seed = nullptr);
+    static std::vector<CurveParam> calcBlockCurves(
+            const std::vector<std::vector<float>> &vars, const int *spp,
+            int w, int h, int block, bool useLastTwoPoint = true);
+    static size_t fitStart(const std::vector<std::vector<float>> &vars,
+                           bool useLastTwoPoint = true);
+    static std::vector<CurveParam> interpolateCurves(
+            const std::vector<CurveParam> &blocks, int w, int h, int block);
     static int calcMinWeight(float v, float s, float i, int spp);
+    static int sampleBudget(float target, float v, const CurveParam &outs,
+                            int spp, int weight);
+    static float predictVariance(float v, const CurveParam &outs, int spp,
+                                 float n);
+    static int stopSpp(float target, const std::vector<float> &var,
+                       const std::vector<float> &denoised,
+                       const std::vector<CurveParam> &params,
+                       const std::vector<int> &weights, int spp);
 
 private:
     static std::vector<float> _jacobian(const std::vector<float> &denoised,
                                         const std::vector<float> &noisy,
                                         int w, int h,
                                         const std::vector<float> &var, float e,
-                                        bool optiX, bool hdr, bool cleanAux);
+                                        ImageDenoiser::Backend backend,
+                                        bool hdr, bool cleanAux,
+                                        ImageDenoiser::Quality quality);
+    static CurveParam _fitCurve(const std::vector<float> &vals,
+                                const int *spp, bool useLastTwoPoint);
+    static size_t _fitTail(const std::vector<float> &vals,
+                           bool useLastTwoPoint,
+                           std::vector<float> &goodVals, size_t &idx0);
     static CurveParam _leastSquares(const std::vector<float> &x,
                                     const std::vector<float> &y);
+    static CurveParam _anchorSeed(const CurveParam &seed, float v, int spp);
 };
 
 #endif // CURVEPREDICTOR_H
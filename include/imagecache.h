@@ -0,0 +1,52 @@
+/**
+ * @file imagecache.h
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <vector>
+#include <list>
+#include <map>
+#include <string>
+#include <mutex>
+#include <ostream>
+
+class ImageCache
+{
+private:
+    ImageCache();
+
+public:
+    static ImageCache *instance();
+    void setCapacity(size_t bytes);
+    bool get(const std::string &fileName, bool nonNegative,
+             std::vector<float> &data, int &w, int &h);
+    void put(const std::string &fileName, bool nonNegative,
+             const std::vector<float> &data, int w, int h);
+    void report(std::ostream &out) const;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::vector<float> data;
+        int w;
+        int h;
+    };
+    static std::string _key(const std::string &fileName, bool nonNegative);
+    static ImageCache *m_instance;
+    size_t m_capacity;
+    size_t m_bytes;
+    size_t m_hits;
+    size_t m_misses;
+    // Most recently used first
+    std::list<Entry> m_entries;
+    std::map<std::string, std::list<Entry>::iterator> m_index;
+    mutable std::mutex m_mutex;
+};
+
+#endif // IMAGECACHE_H
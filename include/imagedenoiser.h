@@ -9,6 +9,7 @@
 #define IMAGEDENOISER_H
 
 #include <vector>
+#include <mutex>
 
 class ImageDenoiser
 {
@@ -16,11 +17,18 @@ private:
     ImageDenoiser();
 
 public:
+    enum Quality { High, Balanced };
+    enum Backend { OIDN, OptiX, ATrous };
+
     static ImageDenoiser *instance();
+    void configure(int numThreads, bool setAffinity, bool useCuda,
+                   bool useOptiX);
     bool init();
     bool run(const std::vector<float> &input, int w, int h,
-             std::vector<float> &output, bool optiX, bool hdr, bool cleanAux,
-             bool cpu = false) const;
+             std::vector<float> &output, Backend backend, bool hdr,
+             bool cleanAux,
+             Quality quality = High, bool cpu = false) const;
+    double waitedMs() const;
     void release();
 
 private:
@@ -29,9 +37,15 @@ private:
     bool _runOptiX(const std::vector<float> &input, int w, int h,
                    std::vector<float> &output, bool hdr) const;
     static ImageDenoiser *m_instance;
+    // Frames of a batch share the instance; runs are serialized
+    mutable std::mutex m_mutex;
     void *m_cpuData[3];
     void *m_gpuData[3];
     void *m_optiXData[3];
+    int m_numThreads;
+    bool m_setAffinity;
+    bool m_useCuda;
+    bool m_useOptiX;
 };
 
 #endif // IMAGEDENOISER_H
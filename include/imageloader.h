@@ -15,18 +15,49 @@
 class ImageLoader
 {
 public:
+    // What a file is for decides how it is encoded
+    enum ExrClass { Intermediate, Debug, Delivered, ExrClassCount };
+    enum Compression { NoCompression, Rle, Zips, Zip, Piz, Dwaa };
+    struct ExrFormat
+    {
+        Compression compression;
+        bool half;
+    };
+
     static std::vector<float> loadImage(const std::string &fileName,
-                                        int &w, int &h);
+                                        int &w, int &h,
+                                        bool nonNegative = false,
+                                        bool reused = false);
+    static bool imageSize(const std::string &fileName, int &w, int &h);
+    static bool endsWith(const std::string &name, const std::string &ext);
+    static size_t sanitize(std::vector<float> &img, bool nonNegative);
     static std::vector<CurveParam> loadCurves(const std::string &name0,
                                               const std::string &name1,
                                               int &w, int &h);
     static std::vector<int> loadWeights(const std::string &name, int w, int h);
     static bool saveExr(const std::vector<float> &data, int w, int h,
-                        const std::string &name);
+                        const std::string &name,
+                        ExrClass cls = Intermediate);
+    static bool saveExr(const std::vector<float> &data, int w, int h,
+                        const std::string &name, const ExrFormat &format);
     static bool saveExr(const std::vector<CurveParam> &data, int w, int h,
-                        const std::string &name0, const std::string &name1);
+                        const std::string &name0, const std::string &name1,
+                        ExrClass cls = Debug);
     static bool saveExr(const std::vector<int> &data, int w, int h,
+                        const std::string &name, ExrClass cls = Debug);
+    static void setExrFormat(ExrClass cls, const ExrFormat &format);
+    static void setExrThreads(int numThreads);
+    static std::vector<float> loadRaw(const std::string &fileName,
+                                      int &w, int &h);
+    static bool saveRaw(const std::vector<float> &data, int w, int h,
                         const std::string &name);
+    static bool loadCheckpoint(const std::string &fileName, int &w, int &h,
+                               std::vector<int> &spp,
+                               std::vector<std::vector<float>> &vars);
+    static bool saveCheckpoint(const std::vector<int> &spp,
+                               const std::vector<std::vector<float>> &vars,
+                               size_t count, int w, int h,
+                               const std::string &name);
     static void gaussianBlur(const std::vector<float> &src,
                              std::vector<float> &dst,
                              int w, int h, int kernelSize,
@@ -38,6 +69,37 @@ public:
                                         const std::vector<float> &img2);
     static std::vector<float> diff(const std::vector<float> &img,
                                    const std::vector<float> &ref);
+    static std::vector<float> luminance(const std::vector<float> &img,
+                                        bool channelMax = false);
+    static std::vector<float> crop(const std::vector<float> &img, int w, int h,
+                                   int x, int y, int cw, int ch);
+    static void paste(const std::vector<float> &src, int sw, int sx, int sy,
+                      std::vector<float> &dst, int w, int x, int y,
+                      int rw, int rh);
+    static void changedTiles(const std::vector<float> &img,
+                             const std::vector<float> &prev, int w, int h,
+                             int tile, std::vector<char> &dirty);
+    static void activeTiles(const std::vector<float> &var, int w, int h,
+                            int tile, float threshold,
+                            std::vector<char> &active);
+    static bool loadMoments(const std::string &name0,
+                            const std::string &name1, int n, bool welford,
+                            int &w, int &h, std::vector<float> &mean,
+                            std::vector<float> &m2);
+    static void mergeMoments(std::vector<float> &mean, std::vector<float> &m2,
+                             int n, const std::vector<float> &mean2,
+                             const std::vector<float> &m22, int n2);
+    static void fromMoments(const std::vector<float> &mean,
+                            const std::vector<float> &m2, int n,
+                            std::vector<float> &img, std::vector<float> &var);
+
+private:
+    static std::vector<float> _loadFloat(const std::string &fileName,
+                                         int &w, int &h);
+    static bool _writeRgb(const std::string &name, int w, int h,
+                          const char *base, size_t xStride,
+                          size_t channelStride, const ExrFormat &format);
+    static ExrFormat m_formats[ExrClassCount];
 };
 
 #endif // IMAGELOADER_H
@@ -0,0 +1,44 @@
+/**
+ * @file stagescheduler.h
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#ifndef STAGESCHEDULER_H
+#define STAGESCHEDULER_H
+
+#include <string>
+#include <mutex>
+#include "imagedenoiser.h"
+
+class StageScheduler
+{
+public:
+    enum Stage { DenoiseHigh, DenoiseBalanced, Blur, StageCount };
+
+    struct Plan
+    {
+        ImageDenoiser::Quality denoiseQuality;
+        ImageDenoiser::Quality sureQuality;
+        ImageDenoiser::Quality estimateQuality;
+        int sureTries;
+        bool applyGB;
+    };
+
+    explicit StageScheduler(float budgetMs);
+    bool load(const std::string &fileName);
+    bool save(const std::string &fileName) const;
+    void record(Stage stage, double ms, int w, int h);
+    Plan plan(int w, int h) const;
+    static Stage denoiseStage(ImageDenoiser::Quality quality);
+
+private:
+    float _cost(const Plan &plan, int w, int h) const;
+    float _denoiseCost(ImageDenoiser::Quality quality) const;
+    float m_budget;
+    float m_msPerMPixel[StageCount];
+    mutable std::mutex m_mutex;
+};
+
+#endif // STAGESCHEDULER_H
@@ -0,0 +1,51 @@
+/**
+ * @file threadpool.h
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool
+{
+private:
+    ThreadPool();
+
+public:
+    ~ThreadPool();
+    static ThreadPool *instance();
+    void setThreads(int numThreads);
+    int threads() const;
+    void parallelFor(size_t n,
+                     const std::function<void(size_t, size_t)> &body,
+                     size_t grain = 4096);
+    double parallelReduce(size_t n,
+                          const std::function<double(size_t, size_t)> &body,
+                          size_t grain = 4096);
+
+private:
+    struct Job;
+    void _start(int numThreads);
+    void _stop();
+    void _worker();
+    void _runChunks(Job &job);
+    static ThreadPool *m_instance;
+    std::vector<std::thread> m_workers;
+    std::deque<std::shared_ptr<Job>> m_jobs;
+    bool m_stopping = false;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_finished;
+};
+
+#endif // THREADPOOL_H
@@ -0,0 +1,44 @@
+/**
+ * @file tilesharder.h
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#ifndef TILESHARDER_H
+#define TILESHARDER_H
+
+#include <vector>
+#include <string>
+#include <ostream>
+
+class TileSharder
+{
+public:
+    struct Shard
+    {
+        std::string dir;
+        // Core region in the frame and the crop around it
+        int x, y, rw, rh;
+        int cx, cy, cw, ch;
+    };
+
+    TileSharder(const std::string &path, int tile, int halo);
+    bool split(std::ostream &out);
+    bool run(const std::string &program, const std::string &args,
+             int workers, std::ostream &out);
+    std::vector<float> gather(const std::string &name, bool consume);
+    std::vector<std::string> stitch(std::ostream &out);
+    const std::vector<std::string> &inputs() const;
+
+private:
+    std::string m_path;
+    int m_tile;
+    int m_halo;
+    int m_w;
+    int m_h;
+    std::vector<std::string> m_inputs;
+    std::vector<Shard> m_shards;
+};
+
+#endif // TILESHARDER_H
@@ -0,0 +1,110 @@
+/**
+ * @file atrousfilter.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#include "atrousfilter.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// B3-spline taps
+const float taps[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+const int iterations = 5;
+const float sigmaAlbedo = 0.1f;
+const float sigmaNormal = 0.2f;
+
+// Compress HDR values so the edge-stopping weight sees relative changes
+inline float tonemap(float v, bool hdr)
+{
+    return hdr ? v / (1 + std::abs(v)) : v;
+}
+}
+
+// Edge-avoiding a-trous wavelet filter guided by albedo and normal
+// (Dammertz et al. 2010)
+void ATrousFilter::run(const std::vector<float> &input, int w, int h,
+                       std::vector<float> &output, bool hdr)
+{
+    size_t len = 3 * size_t(w * h);
+    const float *albedo = input.size() >= 2 * len ? input.data() + len
+                                                  : nullptr;
+    const float *normal = input.size() >= 3 * len ? input.data() + 2 * len
+                                                  : nullptr;
+    std::vector<float> src(input.begin(), input.begin() + long(len));
+    std::vector<float> dst(len);
+    float sigmaC = 0.5f;
+    for(int i = 0; i < iterations; i++)
+    {
+        ThreadPool::instance()->parallelFor(
+                    size_t(h), [&](size_t y0, size_t y1) {
+            _pass(src, dst, albedo, normal, w, h, 1 << i, sigmaC, hdr,
+                  int(y0), int(y1));
+        }, 1);
+        src.swap(dst);
+        sigmaC *= 0.5f;
+    }
+    output.swap(src);
+}
+
+void ATrousFilter::_pass(const std::vector<float> &src,
+                         std::vector<float> &dst,
+                         const float *albedo, const float *normal,
+                         int w, int h, int step, float sigmaC, bool hdr,
+                         int y0, int y1)
+{
+    float invC = 1.0f / (sigmaC * sigmaC);
+    float invA = 1.0f / (sigmaAlbedo * sigmaAlbedo);
+    float invN = 1.0f / (sigmaNormal * sigmaNormal);
+    for(int y = y0; y < y1; y++)
+    {
+        for(int x = 0; x < w; x++)
+        {
+            size_t p = 3 * size_t(x + y * w);
+            float cr = tonemap(src[p], hdr);
+            float cg = tonemap(src[p + 1], hdr);
+            float cb = tonemap(src[p + 2], hdr);
+            float sum[3] = {0, 0, 0};
+            float weightSum = 0;
+            for(int ky = 0; ky < 5; ky++)
+            {
+                int qy = std::min(std::max(y + (ky - 2) * step, 0), h - 1);
+                for(int kx = 0; kx < 5; kx++)
+                {
+                    int qx = std::min(std::max(x + (kx - 2) * step, 0), w - 1);
+                    size_t q = 3 * size_t(qx + qy * w);
+                    float dr = tonemap(src[q], hdr) - cr;
+                    float dg = tonemap(src[q + 1], hdr) - cg;
+                    float db = tonemap(src[q + 2], hdr) - cb;
+                    float e = (dr * dr + dg * dg + db * db) * invC;
+                    if(albedo)
+                    {
+                        float ar = albedo[q] - albedo[p];
+                        float ag = albedo[q + 1] - albedo[p + 1];
+                        float ab = albedo[q + 2] - albedo[p + 2];
+                        e += (ar * ar + ag * ag + ab * ab) * invA;
+                    }
+                    if(normal)
+                    {
+                        float nx = normal[q] - normal[p];
+                        float ny = normal[q + 1] - normal[p + 1];
+                        float nz = normal[q + 2] - normal[p + 2];
+                        e += (nx * nx + ny * ny + nz * nz) * invN;
+                    }
+                    float weight = taps[kx] * taps[ky] * std::exp(-e);
+                    sum[0] += weight * src[q];
+                    sum[1] += weight * src[q + 1];
+                    sum[2] += weight * src[q + 2];
+                    weightSum += weight;
+                }
+            }
+            // The center tap always has weight > 0
+            dst[p] = sum[0] / weightSum;
+            dst[p + 1] = sum[1] / weightSum;
+            dst[p + 2] = sum[2] / weightSum;
+        }
+    }
+}
@@ -0,0 +1,117 @@
+/**
+ * @file bufferpool.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#include "bufferpool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+// Enough for all full frames of one spp level of a few frames in flight
+const size_t maxFree = 32;
+}
+
+BufferPool *BufferPool::m_instance = nullptr;
+
+BufferPool::BufferPool()
+{
+}
+
+BufferPool *BufferPool::instance()
+{
+    static std::mutex instanceMutex;
+    std::lock_guard<std::mutex> lock(instanceMutex);
+    if(!m_instance)
+        m_instance = new BufferPool();
+
+    return m_instance;
+}
+
+// Contents of a reused buffer are stale: callers overwrite all of it
+std::vector<float> BufferPool::acquire(size_t len, const char *stage)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    StageStats &stats = m_stats[stage];
+    size_t best = m_free.size();
+    for(size_t i = 0; i < m_free.size(); i++)
+    {
+        if(m_free[i].capacity() >= len
+                && (best == m_free.size()
+                    || m_free[i].capacity() < m_free[best].capacity()))
+            best = i;
+    }
+    std::vector<float> buf;
+    if(best < m_free.size())
+    {
+        buf.swap(m_free[best]);
+        m_free.erase(m_free.begin() + long(best));
+        stats.reuses++;
+    }
+    else
+    {
+        stats.allocs++;
+        stats.bytes += len * sizeof(float);
+    }
+    buf.resize(len);
+    return buf;
+}
+
+void BufferPool::release(std::vector<float> &buf)
+{
+    if(buf.capacity() == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_free.size() < maxFree)
+    {
+        m_free.push_back(std::vector<float>());
+        m_free.back().swap(buf);
+    }
+    buf.clear();
+}
+
+void BufferPool::release(std::initializer_list<std::vector<float> *> bufs)
+{
+    for(std::vector<float> *buf : bufs)
+        release(*buf);
+}
+
+void BufferPool::report(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out << "Peak RSS: " << peakRss() / (1024 * 1024) << " MB" << std::endl;
+    for(const auto &stats : m_stats)
+    {
+        out << "\t" << stats.first << ": " << stats.second.allocs
+            << " allocs (" << stats.second.bytes / (1024 * 1024) << " MB), "
+            << stats.second.reuses << " reuses" << std::endl;
+    }
+}
+
+size_t BufferPool::peakRss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return size_t(usage.ru_maxrss);
+#else
+    return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
@@ -8,34 +8,177 @@
 #include "curvepredictor.h"
 #include "imagedenoiser.h"
 #include "imageloader.h"
+#include "bufferpool.h"
+#include "threadpool.h"
 #include <algorithm>
+#include <mutex>
 #include <random>
 
 std::vector<float> CurvePredictor::sure(const std::vector<float> &denoised,
                                         const std::vector<float> &noisy,
                                         int w, int h,
                                         const std::vector<float> &var,
-                                        bool useOptiX, bool hdr, bool cleanAux)
+                                        ImageDenoiser::Backend backend,
+                                        bool hdr, bool cleanAux, int tries,
+                                        ImageDenoiser::Quality quality)
 {
-    const int tries = 1;
     const float e = 1;
-    std::vector<float> jacob(denoised.size(), 0.0f);
+    ThreadPool *threads = ThreadPool::instance();
+    std::vector<float> jacob = BufferPool::instance()->acquire(denoised.size(),
+                                                               "sure");
+    std::fill(jacob.begin(), jacob.end(), 0.0f);
 
     for(int i = 0; i < tries; i++)
     {
         std::vector<float> jacob0 = _jacobian(denoised, noisy, w, h, var, e,
-                                              useOptiX, hdr, cleanAux);
-        std::transform(jacob.begin(), jacob.end(), jacob0.begin(),
-                       jacob.begin(), std::plus<float>());
+                                              backend, hdr, cleanAux,
+                                              quality);
+        threads->parallelFor(jacob.size(), [&](size_t begin, size_t end) {
+            for(size_t k = begin; k < end; k++)
+                jacob[k] += jacob0[k];
+        });
+        BufferPool::instance()->release(jacob0);
     }
-    std::vector<float> mse = ImageLoader::mseVector(denoised, noisy);
-    for(size_t i = 0; i < jacob.size(); i++)
+    // SURE = (f(y) - y)^2 - var + 2 var div, fused in one pass
+    threads->parallelFor(jacob.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+        {
+            float d = denoised[i] - noisy[i];
+            float j = 2 * jacob[i] / tries;
+            float v = var[i];
+            jacob[i] = d * d - v + j;
+        }
+    });
+    return jacob;
+}
+
+std::vector<float> CurvePredictor::sureTiled(const std::vector<float> &denoised,
+                                             const std::vector<float> &noisy,
+                                             int w, int h,
+                                             const std::vector<float> &var,
+                                             float fraction,
+                                             ImageDenoiser::Backend backend,
+                                             bool hdr, bool cleanAux,
+                                             ImageDenoiser::Quality quality)
+{
+    const int tile = 128;
+    const int halo = 32;
+    const float e = 1;
+    int tilesX = (w + tile - 1) / tile;
+    int tilesY = (h + tile - 1) / tile;
+    int tiles = tilesX * tilesY;
+    int sampled = std::min(std::max(int(std::ceil(fraction * tiles)), 1),
+                           tiles);
+    // OptiX buffers are bound to the frame size
+    if(backend == ImageDenoiser::OptiX || sampled == tiles)
+        return sure(denoised, noisy, w, h, var, backend, hdr, cleanAux, 1,
+                    quality);
+
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::vector<int> order(size_t(tiles), 0);
+    for(int t = 0; t < tiles; t++)
+        order[size_t(t)] = t;
+    std::shuffle(order.begin(), order.end(), gen);
+
+    // Crops have the same size so the denoiser keeps its buffers
+    int cw = std::min(w, tile + 2 * halo);
+    int ch = std::min(h, tile + 2 * halo);
+    std::vector<float> div = BufferPool::instance()->acquire(denoised.size(),
+                                                             "sure");
+    std::vector<float> ratio(3 * size_t(tiles), 0.0f);
+    std::vector<bool> done(size_t(tiles), false);
+    for(int s = 0; s < sampled; s++)
     {
-        float j = 2 * jacob[i] / tries;
-        float v = std::isnormal(var[i]) ? var[i] : 0.f;
-        jacob[i] = mse[i] - v + j;
+        int t = order[size_t(s)];
+        int x0 = (t % tilesX) * tile;
+        int y0 = (t / tilesX) * tile;
+        int x1 = std::min(x0 + tile, w);
+        int y1 = std::min(y0 + tile, h);
+        int cx = std::min(std::max(x0 - halo, 0), w - cw);
+        int cy = std::min(std::max(y0 - halo, 0), h - ch);
+
+        std::vector<float> jacob = _jacobian(
+                    ImageLoader::crop(denoised, w, h, cx, cy, cw, ch),
+                    ImageLoader::crop(noisy, w, h, cx, cy, cw, ch), cw, ch,
+                    ImageLoader::crop(var, w, h, cx, cy, cw, ch), e,
+                    backend, hdr, cleanAux, quality);
+        if(jacob.empty())
+            return sure(denoised, noisy, w, h, var, backend, hdr, cleanAux, 1,
+                        quality);
+
+        float sumDiv[3] = {0, 0, 0};
+        float sumVar[3] = {0, 0, 0};
+        for(int y = y0; y < y1; y++)
+        {
+            for(int x = x0; x < x1; x++)
+            {
+                size_t idx = 3 * size_t(x + y * w);
+                size_t cIdx = 3 * size_t(x - cx + (y - cy) * cw);
+                for(size_t c = 0; c < 3; c++)
+                {
+                    float v = var[idx + c];
+                    div[idx + c] = jacob[cIdx + c];
+                    sumDiv[c] += jacob[cIdx + c];
+                    sumVar[c] += v;
+                }
+            }
+        }
+        for(size_t c = 0; c < 3; c++)
+            ratio[3 * size_t(t) + c] = sumVar[c] > 0 ? sumDiv[c] / sumVar[c]
+                                                     : 0.0f;
+        done[size_t(t)] = true;
     }
-    return jacob;
+    // Divergence of unsampled tiles: var times the inverse-distance
+    // weighted divergence-to-variance ratio of the sampled tiles
+    ThreadPool *threads = ThreadPool::instance();
+    threads->parallelFor(size_t(tiles), [&](size_t t0, size_t t1) {
+        for(int t = int(t0); t < int(t1); t++)
+        {
+            if(done[size_t(t)])
+                continue;
+
+            int tx = t % tilesX;
+            int ty = t / tilesX;
+            float k[3] = {0, 0, 0};
+            float weightSum = 0;
+            for(int s = 0; s < sampled; s++)
+            {
+                int u = order[size_t(s)];
+                int dx = u % tilesX - tx;
+                int dy = u / tilesX - ty;
+                float weight = 1.0f / float(dx * dx + dy * dy);
+                for(size_t c = 0; c < 3; c++)
+                    k[c] += weight * ratio[3 * size_t(u) + c];
+                weightSum += weight;
+            }
+            int x0 = tx * tile;
+            int y0 = ty * tile;
+            int x1 = std::min(x0 + tile, w);
+            int y1 = std::min(y0 + tile, h);
+            for(int y = y0; y < y1; y++)
+            {
+                for(int x = x0; x < x1; x++)
+                {
+                    size_t idx = 3 * size_t(x + y * w);
+                    for(size_t c = 0; c < 3; c++)
+                    {
+                        float v = var[idx + c];
+                        div[idx + c] = k[c] / weightSum * v;
+                    }
+                }
+            }
+        }
+    }, 1);
+    threads->parallelFor(div.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+        {
+            float d = denoised[i] - noisy[i];
+            float v = var[i];
+            div[i] = d * d - v + 2 * div[i];
+        }
+    });
+    return div;
 }
 
 int CurvePredictor::denoisedWeight(float sure, const CurveParam &outs,
@@ -68,81 +211,147 @@ void CurvePredictor::blend(const std::vector<float> &img1,
 {
     size_t len = std::min(img1.size(), img2.size());
     blended.resize(len);
-    std::transform(img2.begin(), img2.begin() + int(len), w2.begin(),
-                   blended.begin(), [](float a, int b) {
-                       return a * b;
-                   });
-    std::transform(img1.begin(), img1.begin() + int(len), blended.begin(),
-                   blended.begin(), [w1](float a, float b) {
-                       return a * w1 + b;
-                   });
-    std::transform(w2.begin(), w2.begin() + int(len), blended.begin(),
-                   blended.begin(), [w1](int a, float b) {
-                       return b / (w1 + a);
-                   });
+    ThreadPool::instance()->parallelFor(len, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+            blended[i] = (img1[i] * w1 + img2[i] * w2[i]) / (w1 + w2[i]);
+    });
 }
 
 std::vector<CurveParam> CurvePredictor::calcCurves(
         const std::vector<std::vector<float> > &vars, const int *spp,
-        bool useLastTwoPoint)
+        bool useLastTwoPoint, const std::vector<char> *dirty,
+        const std::vector<CurveParam> *prev,
+        const std::vector<CurveParam> *seed)
 {
     std::vector<CurveParam> params(vars[0].size(), CurveParam(.0f, .0f));
-    if(vars.size() < 2)
+    // A seed of another size (resolution, luminance mode) is of no use
+    if(seed && seed->size() != params.size())
+        seed = nullptr;
+    if(vars.size() < 2 && !seed)
         return params;
 
-    for(size_t i = 0; i < params.size(); i++)
-    {
-        std::vector<float> vals;
-        for(size_t j = 0; j < vars.size(); j++)
+    // Per-pixel mask: pixels that did not change keep their previous curve,
+    // or no curve without one
+    size_t stride = dirty ? params.size() / dirty->size() : 1;
+    ThreadPool::instance()->parallelFor(
+                params.size(), [&](size_t begin, size_t end) {
+        std::vector<float> vals(vars.size());
+        for(size_t i = begin; i < end; i++)
         {
-            float v = vars[j][i];
-            vals.push_back(std::isnormal(v) ? v : 0.0f);
+            if(dirty && !(*dirty)[i / stride])
+            {
+                if(prev)
+                    params[i] = (*prev)[i];
+                continue;
+            }
+            for(size_t j = 0; j < vars.size(); j++)
+                vals[j] = vars[j][i];
+
+            params[i] = _fitCurve(vals, spp, useLastTwoPoint);
+            // Too few decreasing points yet: start from the seed
+            if(seed && params[i].first == 0 && params[i].second == 0)
+                params[i] = _anchorSeed((*seed)[i], vals.back(),
+                                        spp[vars.size() - 1]);
         }
-        size_t idx0 = 1;
-        std::vector<float> goodVals;
-        for(size_t j = vals.size() - 1; j > 0; j--)
+    }, 256);
+    return params;
+}
+
+// One curve per block x block pixels, fitted to the mean variance of the
+// block; returns blocksX * blocksY entries per channel
+std::vector<CurveParam> CurvePredictor::calcBlockCurves(
+        const std::vector<std::vector<float> > &vars, const int *spp,
+        int w, int h, int block, bool useLastTwoPoint)
+{
+    size_t channels = vars[0].size() / size_t(w * h);
+    int blocksX = (w + block - 1) / block;
+    int blocksY = (h + block - 1) / block;
+    std::vector<CurveParam> params(channels * size_t(blocksX * blocksY),
+                                   CurveParam(.0f, .0f));
+    if(vars.size() < 2)
+        return params;
+
+    ThreadPool::instance()->parallelFor(
+                size_t(blocksX * blocksY), [&](size_t begin, size_t end) {
+        std::vector<float> vals(vars.size());
+        for(size_t t = begin; t < end; t++)
         {
-            if(vals[j] < vals[j - 1])
+            int x0 = int(t % size_t(blocksX)) * block;
+            int y0 = int(t / size_t(blocksX)) * block;
+            int x1 = std::min(x0 + block, w);
+            int y1 = std::min(y0 + block, h);
+            float count = float((x1 - x0) * (y1 - y0));
+            for(size_t c = 0; c < channels; c++)
             {
-                if(vals[j] > 0)
+                for(size_t j = 0; j < vars.size(); j++)
                 {
-                    goodVals.insert(goodVals.begin(), vals[j]);
-                    if(useLastTwoPoint && goodVals.size() == 2)
+                    float sum = 0;
+                    for(int y = y0; y < y1; y++)
                     {
-                        idx0 = j;
-                        break;
+                        for(int x = x0; x < x1; x++)
+                            sum += vars[j][channels * size_t(x + y * w) + c];
                     }
+                    vals[j] = sum / count;
                 }
-            }
-            else
-            {
-                goodVals.insert(goodVals.begin(), vals[j]);
-                idx0 = j;
-                break;
+                params[channels * t + c] = _fitCurve(vals, spp,
+                                                     useLastTwoPoint);
             }
         }
-        size_t idx1 = idx0 + goodVals.size() - 1;
-        size_t len = idx1 - idx0 + 1;
-        if(int(len) < 2)
-            continue;
+    }, 16);
+    return params;
+}
 
-        std::vector<float> x(len);
-        std::vector<float> y(len);
-        const float c = 100;
-        for(size_t k = idx0; k <= idx1; k++)
+// Per-pixel curves, bilinear between block centers; blocks without a fit
+// are left out of the weights
+std::vector<CurveParam> CurvePredictor::interpolateCurves(
+        const std::vector<CurveParam> &blocks, int w, int h, int block)
+{
+    int blocksX = (w + block - 1) / block;
+    int blocksY = (h + block - 1) / block;
+    size_t channels = blocks.size() / size_t(blocksX * blocksY);
+    std::vector<CurveParam> params(channels * size_t(w * h));
+    ThreadPool::instance()->parallelFor(
+                size_t(h), [&](size_t r0, size_t r1) {
+        for(int y = int(r0); y < int(r1); y++)
         {
-            float A = std::log(float(spp[k]));
-            float B = std::log(goodVals[k - idx0]);
-            x[k - idx0] = 1.0f / A;
-            y[k - idx0] = std::log(B + c) / A;
-        }
-        CurveParam slopeIntercept = _leastSquares(x, y);
-        float b = slopeIntercept.second;
-        float a = slopeIntercept.first;
-        a = std::exp(a);
+            float fy = (y + 0.5f) / block - 0.5f;
+            int by = std::min(std::max(int(std::floor(fy)), 0), blocksY - 1);
+            int by1 = std::min(by + 1, blocksY - 1);
+            float ty = std::min(std::max(fy - by, 0.0f), 1.0f);
+            for(int x = 0; x < w; x++)
+            {
+                float fx = (x + 0.5f) / block - 0.5f;
+                int bx = std::min(std::max(int(std::floor(fx)), 0),
+                                  blocksX - 1);
+                int bx1 = std::min(bx + 1, blocksX - 1);
+                float tx = std::min(std::max(fx - bx, 0.0f), 1.0f);
+                const size_t idx[4] = {
+                    size_t(bx + by * blocksX), size_t(bx1 + by * blocksX),
+                    size_t(bx + by1 * blocksX), size_t(bx1 + by1 * blocksX)
+                };
+                const float wgt[4] = {
+                    (1 - tx) * (1 - ty), tx * (1 - ty), (1 - tx) * ty, tx * ty
+                };
+                for(size_t c = 0; c < channels; c++)
+                {
+                    float a = 0, b = 0, sum = 0;
+                    for(int k = 0; k < 4; k++)
+                    {
+                        const CurveParam &cp = blocks[channels * idx[k] + c];
+                        if(cp.first < 1e-6f && cp.second < 1e-6f)
+                            continue;
 
-        params[i] = CurveParam(a, b);
-    }
+                        a += wgt[k] * cp.first;
+                        b += wgt[k] * cp.second;
+                        sum += wgt[k];
+                    }
+                    params[channels * size_t(x + y * w) + c] = sum > 0
+                            ? CurveParam(a / sum, b / sum)
+                            : CurveParam(.0f, .0f);
+                }
+            }
+        }
+    }, 1);
     return params;
 }
 
@@ -164,36 +373,243 @@ int CurvePredictor::calcMinWeight(float v, float s, float i, int spp)
     return std::min(int(std::round(minWeight)), 65536);
 }
 
+int CurvePredictor::sampleBudget(float target, float v,
+                                 const CurveParam &outs, int spp, int weight)
+{
+    const int limit = 65536;
+    // Denoiser weight saturated: the blend already handles this pixel
+    if(weight >= limit)
+        return 0;
+
+    if(target <= 1e-12f)
+        return limit;
+
+    float x = 0;
+    if(outs.first < 1e-6f && outs.second < 1e-6f)
+    {
+        // No curve yet: assume plain MC convergence, i.e. var ~ 1 / spp
+        if(v > 0)
+            x = spp * v / target;
+    }
+    else
+    {
+        const float c = 100;
+        x = std::pow((std::log(target) + c) / outs.first, 1.0f / outs.second);
+    }
+    // The blend behaves like an estimate with spp + weight samples
+    x -= float(spp + weight);
+    if(!(x > 0))
+        return 0;
+
+    if(x >= limit)
+        return limit;
+
+    return int(std::ceil(x));
+}
+
+float CurvePredictor::predictVariance(float v, const CurveParam &outs,
+                                      int spp, float n)
+{
+    // No curve yet: assume plain MC convergence, i.e. var ~ 1 / spp
+    if(outs.first < 1e-6f && outs.second < 1e-6f)
+        return v * spp / n;
+
+    const float c = 100;
+    return std::exp(outs.first * std::pow(n, outs.second) - c);
+}
+
+int CurvePredictor::stopSpp(float target, const std::vector<float> &var,
+                            const std::vector<float> &denoised,
+                            const std::vector<CurveParam> &params,
+                            const std::vector<int> &weights, int spp)
+{
+    const int limit = 65536;
+    size_t len = std::min(var.size(), params.size());
+    if(len == 0)
+        return -1;
+
+    // Luminance mode: one curve and weight for all channels of a pixel
+    size_t stride = denoised.size() / len;
+
+    // Candidates follow the power-of-two checkpoint ladder
+    for(int n = spp; n <= limit; n *= 2)
+    {
+        double relMse = ThreadPool::instance()->parallelReduce(
+                    len, [&](size_t begin, size_t end) {
+            double part = 0;
+            for(size_t i = begin; i < end; i++)
+            {
+                float v = var[i];
+                float d = 0;
+                for(size_t k = i * stride; k < (i + 1) * stride; k++)
+                    d += denoised[k];
+                d /= stride;
+                // Keep the current weight: the denoiser only gets better
+                float p = predictVariance(v, params[i], spp,
+                                          float(n + weights[i * stride]));
+                if(std::isfinite(p))
+                    part += p / (d * d + 0.01f);
+            }
+            return part;
+        });
+        if(relMse / len <= target)
+            return n;
+    }
+    return -1;
+}
+
 std::vector<float> CurvePredictor::_jacobian(const std::vector<float> &denoised,
                                              const std::vector<float> &noisy,
                                              int w, int h,
                                              const std::vector<float> &var,
-                                             float e, bool optiX, bool hdr,
-                                             bool cleanAux)
+                                             float e,
+                                             ImageDenoiser::Backend backend,
+                                             bool hdr, bool cleanAux,
+                                             ImageDenoiser::Quality quality)
 {
     std::random_device rd;
-    std::mt19937 gen(rd());
-    std::normal_distribution<float> std_nrm(0.f, 1.f);
+    unsigned seed = rd();
 
-    std::vector<float> fy(denoised);
-    std::vector<float> fz(denoised.size());
-    std::vector<float> b(denoised.size());
-    std::vector<float> z(noisy);
+    BufferPool *pool = BufferPool::instance();
+    ThreadPool *threads = ThreadPool::instance();
+    const std::vector<float> &fy = denoised;
+    std::vector<float> fz = pool->acquire(denoised.size(), "probe");
+    std::vector<float> b = pool->acquire(denoised.size(), "probe");
+    // Guides (albedo, normal) follow the color and are not perturbed
+    std::vector<float> z = pool->acquire(noisy.size(), "probe");
+    std::copy(noisy.begin() + long(denoised.size()), noisy.end(),
+              z.begin() + long(denoised.size()));
 
-    for(size_t i = 0; i < denoised.size(); i++)
+    // One generator per chunk, seeded by its offset: the probe does not
+    // depend on the thread count
+    threads->parallelFor(denoised.size(), [&](size_t begin, size_t end) {
+        std::mt19937 gen(seed + unsigned(begin));
+        std::normal_distribution<float> std_nrm(0.f, 1.f);
+        for(size_t i = begin; i < end; i++)
+        {
+            float v = var[i];
+            b[i] = std_nrm(gen) * std::sqrt(v);
+            z[i] = noisy[i] + e * b[i];
+        }
+    });
+    if(!ImageDenoiser::instance()->run(z, w, h, fz, backend, hdr, cleanAux,
+                                       quality))
     {
-        float v = std::isnormal(var[i]) ? var[i] : 0.f;
-        b[i] = std_nrm(gen) * std::sqrt(v);
-        z[i] = noisy[i] + e * b[i];
-    }
-    if(!ImageDenoiser::instance()->run(z, w, h, fz, optiX, hdr, cleanAux))
+        pool->release({&fz, &b, &z});
         return std::vector<float>();
+    }
+    // Reuse the perturbation buffer for the result
+    threads->parallelFor(fy.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+            b[i] = b[i] / e * (fz[i] - fy[i]);
+    });
+
+    pool->release({&fz, &z});
+    return b;
+}
+
+// First estimate any pixel's fit looks at; a fit resumed from the
+// estimates from there on gives the same curves
+size_t CurvePredictor::fitStart(const std::vector<std::vector<float>> &vars,
+                                bool useLastTwoPoint)
+{
+    if(vars.empty())
+        return 0;
+
+    size_t first = vars.size() - 1;
+    std::mutex firstMutex;
+    ThreadPool::instance()->parallelFor(
+                vars[0].size(), [&](size_t begin, size_t end) {
+        std::vector<float> vals(vars.size());
+        std::vector<float> goodVals;
+        size_t idx0;
+        size_t start = vars.size() - 1;
+        for(size_t i = begin; i < end && start > 0; i++)
+        {
+            for(size_t k = 0; k < vars.size(); k++)
+                vals[k] = vars[k][i];
+            start = std::min(start, _fitTail(vals, useLastTwoPoint, goodVals,
+                                             idx0));
+        }
+        std::lock_guard<std::mutex> lock(firstMutex);
+        first = std::min(first, start);
+    }, 256);
+    return first;
+}
+
+// Walk back over the converging tail of vals: decreasing positive values
+// are kept, the first rise ends it. Returns the first index compared
+size_t CurvePredictor::_fitTail(const std::vector<float> &vals,
+                                bool useLastTwoPoint,
+                                std::vector<float> &goodVals, size_t &idx0)
+{
+    idx0 = 1;
+    goodVals.clear();
+    for(size_t j = vals.size() - 1; j > 0; j--)
+    {
+        if(vals[j] < vals[j - 1])
+        {
+            if(vals[j] > 0)
+            {
+                goodVals.insert(goodVals.begin(), vals[j]);
+                if(useLastTwoPoint && goodVals.size() == 2)
+                {
+                    idx0 = j;
+                    return j - 1;
+                }
+            }
+        }
+        else
+        {
+            goodVals.insert(goodVals.begin(), vals[j]);
+            idx0 = j;
+            return j - 1;
+        }
+    }
+    return 0;
+}
+
+// Fit log(var) + c = a * n^b through the converging tail of vals
+CurveParam CurvePredictor::_fitCurve(const std::vector<float> &vals,
+                                     const int *spp, bool useLastTwoPoint)
+{
+    size_t idx0;
+    std::vector<float> goodVals;
+    _fitTail(vals, useLastTwoPoint, goodVals, idx0);
+    size_t idx1 = idx0 + goodVals.size() - 1;
+    size_t len = idx1 - idx0 + 1;
+    if(int(len) < 2)
+        return CurveParam(.0f, .0f);
 
-    std::vector<float> res(denoised.size(), 0);
-    for(size_t i = 0; i < fy.size(); i++)
-        res[i] = b[i] / e * (fz[i] - fy[i]);
+    std::vector<float> x(len);
+    std::vector<float> y(len);
+    const float c = 100;
+    for(size_t k = idx0; k <= idx1; k++)
+    {
+        float A = std::log(float(spp[k]));
+        float B = std::log(goodVals[k - idx0]);
+        x[k - idx0] = 1.0f / A;
+        y[k - idx0] = std::log(B + c) / A;
+    }
+    CurveParam slopeIntercept = _leastSquares(x, y);
+    float b = slopeIntercept.second;
+    float a = slopeIntercept.first;
+    a = std::exp(a);
+
+    return CurveParam(a, b);
+}
+
+// Keep the seed's exponent b and move a so that the curve passes through
+// the latest estimate: log(v) + c = a * spp^b
+CurveParam CurvePredictor::_anchorSeed(const CurveParam &seed, float v,
+                                       int spp)
+{
+    const float c = 100;
+    if(seed.first <= 0 || v <= 0)
+        return seed;
 
-    return res;
+    float a = (std::log(v) + c) / std::pow(float(spp), seed.second);
+    return a > 0 ? CurveParam(a, seed.second) : seed;
 }
 
 CurveParam CurvePredictor::_leastSquares(const std::vector<float> &x,
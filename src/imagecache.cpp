@@ -0,0 +1,111 @@
+/**
+ * @file imagecache.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#include "imagecache.h"
+#include "bufferpool.h"
+#include <filesystem>
+#include <algorithm>
+
+ImageCache *ImageCache::m_instance = nullptr;
+
+ImageCache::ImageCache()
+    : m_capacity(0), m_bytes(0), m_hits(0), m_misses(0)
+{
+}
+
+ImageCache *ImageCache::instance()
+{
+    static std::mutex instanceMutex;
+    std::lock_guard<std::mutex> lock(instanceMutex);
+    if(!m_instance)
+        m_instance = new ImageCache();
+
+    return m_instance;
+}
+
+// 0 turns the cache off
+void ImageCache::setCapacity(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = bytes;
+    while(m_bytes > m_capacity)
+    {
+        m_bytes -= m_entries.back().data.size() * sizeof(float);
+        m_index.erase(m_entries.back().key);
+        m_entries.pop_back();
+    }
+}
+
+// Copies the decoded image into a pool buffer; false on a miss
+bool ImageCache::get(const std::string &fileName, bool nonNegative,
+                     std::vector<float> &data, int &w, int &h)
+{
+    std::string key = _key(fileName, nonNegative);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_capacity == 0 || key.empty())
+        return false;
+
+    auto it = m_index.find(key);
+    if(it == m_index.end())
+    {
+        m_misses++;
+        return false;
+    }
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    const Entry &entry = *it->second;
+    data = BufferPool::instance()->acquire(entry.data.size(), "load");
+    std::copy(entry.data.begin(), entry.data.end(), data.begin());
+    w = entry.w;
+    h = entry.h;
+    m_hits++;
+    return true;
+}
+
+void ImageCache::put(const std::string &fileName, bool nonNegative,
+                     const std::vector<float> &data, int w, int h)
+{
+    size_t bytes = data.size() * sizeof(float);
+    std::string key = _key(fileName, nonNegative);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(bytes > m_capacity || key.empty() || m_index.count(key))
+        return;
+
+    while(m_bytes + bytes > m_capacity)
+    {
+        m_bytes -= m_entries.back().data.size() * sizeof(float);
+        m_index.erase(m_entries.back().key);
+        m_entries.pop_back();
+    }
+    m_entries.push_front(Entry{key, data, w, h});
+    m_index[key] = m_entries.begin();
+    m_bytes += bytes;
+}
+
+void ImageCache::report(std::ostream &out) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t loads = m_hits + m_misses;
+    if(loads == 0)
+        return;
+
+    out << "Image cache: " << m_hits << "/" << loads << " hits ("
+        << 100 * m_hits / loads << "%), " << m_bytes / (1024 * 1024)
+        << " MB held" << std::endl;
+}
+
+// A rewritten file gets a new time stamp, so stale entries are never hit
+std::string ImageCache::_key(const std::string &fileName, bool nonNegative)
+{
+    namespace fs = std::experimental::filesystem;
+    std::error_code ec;
+    auto time = fs::last_write_time(fs::path(fileName), ec);
+    if(ec)
+        return std::string();
+
+    return fileName + "|" + std::to_string(time.time_since_epoch().count())
+            + (nonNegative ? "|+" : "");
+}
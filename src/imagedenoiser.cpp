@@ -6,8 +6,10 @@
 **/
 
 #include "imagedenoiser.h"
+#include "atrousfilter.h"
 #include <stdexcept>
 #include <iostream>
+#include <chrono>
 
 #include <OpenImageDenoise/oidn.hpp>
 #include <optix.h>
@@ -42,21 +44,43 @@ struct OptiXData
     size_t overlap      = 0;
 };
 
+namespace {
+// Per thread: each frame runs its stages on its own thread
+thread_local double threadWaitedMs = 0;
+}
+
 // Initialize static member instance
 ImageDenoiser *ImageDenoiser::m_instance = nullptr;
 
 // Constructor
 ImageDenoiser::ImageDenoiser()
+    : m_numThreads(0), m_setAffinity(true), m_useCuda(false),
+      m_useOptiX(false)
 {
     memset(m_cpuData, 0, 3 * sizeof(void *));
     memset(m_gpuData, 0, 3 * sizeof(void *));
     memset(m_optiXData, 0, 3 * sizeof(void *));
 }
 
+// Time the calling thread spent waiting for runs of other frames, so
+// stage timings can leave it out
+double ImageDenoiser::waitedMs() const
+{
+    return threadWaitedMs;
+}
+
 // Destructor or cleanup function
 void ImageDenoiser::release()
 {
     // Cleanup resources
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(int i = 0; i < 3; i++)
+    {
+        delete static_cast<OidnData *>(m_cpuData[i]);
+        delete static_cast<OidnData *>(m_gpuData[i]);
+        m_cpuData[i] = nullptr;
+        m_gpuData[i] = nullptr;
+    }
     for(int i = 0; i < 3; i++)
     {
         OptiXData *data = static_cast<OptiXData *>(m_optiXData[i]);
@@ -81,43 +105,66 @@ void ImageDenoiser::release()
 // Singleton instance creation
 ImageDenoiser *ImageDenoiser::instance()
 {
+    static std::mutex instanceMutex;
+    std::lock_guard<std::mutex> lock(instanceMutex);
     if(!m_instance)
         m_instance = new ImageDenoiser();
 
     return m_instance;
 }
 
+// Device settings, applied by the next init()
+void ImageDenoiser::configure(int numThreads, bool setAffinity, bool useCuda,
+                              bool useOptiX)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_numThreads = numThreads;
+    m_setAffinity = setAffinity;
+    m_useCuda = useCuda;
+    m_useOptiX = useOptiX;
+}
+
 // Initialization function
 bool ImageDenoiser::init()
 {
-    for(int i = 0; i < 3; i++)
-    {
-        if(m_gpuData[i] || m_cpuData[i])
-            return m_gpuData[0] || m_cpuData[0];
-    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_gpuData[0] || m_cpuData[0] || m_optiXData[0])
+        return true;
+
+    // One device per backend, shared by the filters of all three inputs
+    // (color, +albedo, +normal); CUDA only on request
     for(int k = 0; k < 2; k++)
     {
-        OidnData *data = new OidnData();
+        if(k == 0 && !m_useCuda)
+            continue;
+
+        oidn::DeviceRef device = oidn::newDevice(k == 0
+                                                 ? oidn::DeviceType::CUDA
+                                                 : oidn::DeviceType::CPU);
+        if(k == 1)
+        {
+            device.set("numThreads", m_numThreads);
+            device.set("setAffinity", m_setAffinity);
+        }
+        device.commit();
+        const char *errorMessage;
+        if(!device || device.getError(errorMessage) != oidn::Error::None)
+        {
+            std::cerr << "Denoiser:" << (device ? errorMessage : "no device")
+                      << std::endl;
+            continue;
+        }
         for(int i = 0; i < 3; i++)
         {
-            data->device = oidn::newDevice(k == 0
-                                           ? oidn::DeviceType::CUDA
-                                           : oidn::DeviceType::CPU); // CPU or GPU if available
-            const char *errorMessage;
-            if(data->device.getError(errorMessage) != oidn::Error::None)
-            {
-                std::cerr << "Denoiser:" << errorMessage << std::endl;
-                delete data;
-                continue;
-            }
-            data->device.commit();
+            OidnData *data = new OidnData();
+            data->device = device;
             if(k == 0)
                 m_gpuData[i] = data;
             else
                 m_cpuData[i] = data;
         }
     }
-    bool ok = _createOptiXContext();
+    bool ok = m_useOptiX && _createOptiXContext();
     if(ok)
     {
         for(int i = 0; i < 3; i++)
@@ -128,16 +175,28 @@ bool ImageDenoiser::init()
 
 // Run function
 bool ImageDenoiser::run(const std::vector<float> &input, int w, int h,
-                        std::vector<float> &output, bool optiX, bool hdr,
-                        bool cleanAux, bool cpu) const
+                        std::vector<float> &output, Backend backend, bool hdr,
+                        bool cleanAux, Quality quality, bool cpu) const
 {
-    if(optiX)
+    // Built-in filter: stateless, so no need to serialize
+    if(backend == ATrous)
+    {
+        ATrousFilter::run(input, w, h, output, hdr);
+        return true;
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    threadWaitedMs += std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t0).count();
+    if(backend == OptiX)
         return _runOptiX(input, w, h, output, hdr);
 
     bool useAlb = input.size() >= 6 * size_t(w * h);
     bool useNor = input.size() == 9 * size_t(w * h);
-    OidnData *data = static_cast<OidnData *>(cpu ? m_cpuData[useAlb + useNor]
-                                                 : m_gpuData[useAlb + useNor]);
+    int idx = useAlb + useNor;
+    OidnData *data = static_cast<OidnData *>(cpu || !m_gpuData[idx]
+                                             ? m_cpuData[idx]
+                                             : m_gpuData[idx]);
     if(!data)
         return false;
 
@@ -199,6 +258,13 @@ bool ImageDenoiser::run(const std::vector<float> &input, int w, int h,
         data->filter.set("hdr", hdr);
         data->filter.commit();
     }
+    int oidnQuality = quality == Balanced ? OIDN_QUALITY_BALANCED
+                                          : OIDN_QUALITY_HIGH;
+    if(data->filter.get<int>("quality") != oidnQuality)
+    {
+        data->filter.set("quality", oidnQuality);
+        data->filter.commit();
+    }
     const float *inputPtr = input.data();
     data->colorBuf.write(0, sz, inputPtr);
     if(useAlb)
@@ -6,21 +6,50 @@
 **/
 
 #include "imageloader.h"
+#include "bufferpool.h"
+#include "threadpool.h"
+#include "imagecache.h"
 #define IMATH_DLL
 
 #include <ImfRgbaFile.h>
+#include <ImfInputFile.h>
+#include <ImfFrameBuffer.h>
+#include <ImfOutputFile.h>
+#include <ImfHeader.h>
+#include <ImfChannelList.h>
+#include <ImfCompression.h>
+#include <ImfThreading.h>
 #include <ImfArray.h>
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
 #include <algorithm>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
+// Only images read again later (reused) go through the image cache
 std::vector<float> ImageLoader::loadImage(const std::string &fileName,
-                                          int &w, int &h)
+                                          int &w, int &h, bool nonNegative,
+                                          bool reused)
 {
     if(!std::ifstream(fileName))
         return std::vector<float>();
 
+    std::vector<float> cached;
+    if(reused && ImageCache::instance()->get(fileName, nonNegative, cached,
+                                             w, h))
+        return cached;
+
     try {
         Imf::RgbaInputFile file(fileName.c_str());
         Imath::Box2i dw = file.dataWindow();
@@ -33,20 +62,31 @@ std::vector<float> ImageLoader::loadImage(const std::string &fileName,
         file.readPixels(dw.min.y, dw.max.y);
 
         size_t len = size_t(3 * width * height);
-        std::vector<float> data(len);
-        for(int i = 0; i < height; i++)
-        {
-            for(int j = 0; j < width; j++)
+        std::vector<float> data = BufferPool::instance()->acquire(len, "load");
+        ThreadPool::instance()->parallelFor(
+                    size_t(height), [&](size_t y0, size_t y1) {
+            for(int i = int(y0); i < int(y1); i++)
             {
-                size_t idx = 3 * size_t(j + i * width);
-                Imf::Rgba rgba = pixels[i][j];
-                data[idx] = rgba.r;
-                data[idx + 1] = rgba.g;
-                data[idx + 2] = rgba.b;
+                for(int j = 0; j < width; j++)
+                {
+                    size_t idx = 3 * size_t(j + i * width);
+                    Imf::Rgba rgba = pixels[i][j];
+                    data[idx] = rgba.r;
+                    data[idx + 1] = rgba.g;
+                    data[idx + 2] = rgba.b;
+                }
             }
-        }
+        }, 1);
+        // Downstream kernels assume finite data
+        size_t bad = sanitize(data, nonNegative);
+        if(bad > 0)
+            std::cerr << "Sanitized " << bad << " values in " << fileName
+                      << std::endl;
+
         w = width;
         h = height;
+        if(reused)
+            ImageCache::instance()->put(fileName, nonNegative, data, w, h);
         return data;
     }
     catch (const std::exception &e)
@@ -57,6 +97,35 @@ std::vector<float> ImageLoader::loadImage(const std::string &fileName,
     }
 }
 
+// File name tests: NAME_NNNNNNspp.var.exr ends with spp.var.exr
+bool ImageLoader::endsWith(const std::string &name, const std::string &ext)
+{
+    return name.length() > ext.length()
+            && name.compare(name.length() - ext.length(), ext.length(), ext)
+            == 0;
+}
+
+// Reads only the header
+bool ImageLoader::imageSize(const std::string &fileName, int &w, int &h)
+{
+    if(!std::ifstream(fileName))
+        return false;
+
+    try {
+        Imf::RgbaInputFile file(fileName.c_str());
+        Imath::Box2i dw = file.dataWindow();
+        w = dw.max.x - dw.min.x + 1;
+        h = dw.max.y - dw.min.y + 1;
+        return true;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error reading " << fileName << ": " << e.what()
+                  << std::endl;
+        return false;
+    }
+}
+
 std::vector<CurveParam> ImageLoader::loadCurves(const std::string &name0,
                                                 const std::string &name1,
                                                 int &w, int &h)
@@ -76,6 +145,7 @@ std::vector<CurveParam> ImageLoader::loadCurves(const std::string &name0,
         params[i].first = slope[i];
         params[i].second = intercept[i];
     }
+    BufferPool::instance()->release({&slope, &intercept});
     return params;
 }
 
@@ -90,76 +160,330 @@ std::vector<int> ImageLoader::loadWeights(const std::string &name, int w, int h)
     for(size_t i = 0; i < weights.size(); i++)
         weights[i] = int(std::round(weightsF[i] * 100000.f));
 
+    BufferPool::instance()->release(weightsF);
     return weights;
 }
 
-bool ImageLoader::saveExr(const std::vector<float> &data, int w, int h,
-                          const std::string &name)
+// Intermediates are written fast, delivered frames small
+ImageLoader::ExrFormat ImageLoader::m_formats[ExrClassCount] = {
+    {NoCompression, true}, {Zip, true}, {Piz, true}
+};
+
+void ImageLoader::setExrFormat(ExrClass cls, const ExrFormat &format)
 {
-    const float *ptr = data.data();
-    Imf::Array2D<Imf::Rgba> pixels(h, w);
-    for(int y = 0; y < h; y++)
-    {
-        for(int x = 0; x < w; x++)
+    m_formats[cls] = format;
+}
+
+// OpenEXR compresses and decompresses line blocks on its own pool
+void ImageLoader::setExrThreads(int numThreads)
+{
+    Imf::setGlobalThreadCount(numThreads);
+}
+
+// Interleaved RGB at base goes to the file without an intermediate copy;
+// OpenEXR converts to half where the format asks for it
+bool ImageLoader::_writeRgb(const std::string &name, int w, int h,
+                            const char *base, size_t xStride,
+                            size_t channelStride, const ExrFormat &format)
+{
+    const Imf::Compression compressions[] = {
+        Imf::NO_COMPRESSION, Imf::RLE_COMPRESSION, Imf::ZIPS_COMPRESSION,
+        Imf::ZIP_COMPRESSION, Imf::PIZ_COMPRESSION, Imf::DWAA_COMPRESSION
+    };
+    const char *channels[3] = {"R", "G", "B"};
+    try {
+        Imf::Header header(w, h);
+        header.compression() = compressions[format.compression];
+        Imf::FrameBuffer frameBuffer;
+        for(size_t c = 0; c < 3; c++)
         {
-            pixels[y][x] = Imf::Rgba(ptr[0], ptr[1], ptr[2]);
-            ptr += 3;
+            header.channels().insert(channels[c],
+                                     Imf::Channel(format.half ? Imf::HALF
+                                                              : Imf::FLOAT));
+            frameBuffer.insert(channels[c],
+                               Imf::Slice(Imf::FLOAT,
+                                          const_cast<char *>(
+                                              base + c * channelStride),
+                                          xStride, xStride * size_t(w)));
         }
+        Imf::OutputFile file(name.c_str(), header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(h);
+        return true;
     }
-    Imf::RgbaOutputFile file(name.c_str(), w, h, Imf::WRITE_RGB);
-    file.setFrameBuffer(&pixels[0][0], 1, size_t(w));
-    file.writePixels(h);
-    return true;
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error writing " << name << ": " << e.what()
+                  << std::endl;
+        return false;
+    }
+}
+
+bool ImageLoader::saveExr(const std::vector<float> &data, int w, int h,
+                          const std::string &name, ExrClass cls)
+{
+    return saveExr(data, w, h, name, m_formats[cls]);
+}
+
+// Data that is not an image, such as sample counts, picks its own format
+bool ImageLoader::saveExr(const std::vector<float> &data, int w, int h,
+                          const std::string &name, const ExrFormat &format)
+{
+    return _writeRgb(name, w, h, reinterpret_cast<const char *>(data.data()),
+                     3 * sizeof(float), sizeof(float), format);
 }
 
 bool ImageLoader::saveExr(const std::vector<CurveParam> &data, int w, int h,
-                          const std::string &name0, const std::string &name1)
+                          const std::string &name0, const std::string &name1,
+                          ExrClass cls)
 {
-    const CurveParam *ptr = data.data();
-    Imf::Array2D<Imf::Rgba> pixels0(h, w);
-    Imf::Array2D<Imf::Rgba> pixels1(h, w);
-    for(int y = 0; y < h; y++)
+    // One curve per pixel (luminance mode) is written to all channels
+    size_t step = data.size() == size_t(w * h) ? 0 : 1;
+    size_t xStride = (1 + 2 * step) * sizeof(CurveParam);
+    return _writeRgb(name0, w, h,
+                     reinterpret_cast<const char *>(&data[0].first), xStride,
+                     step * sizeof(CurveParam), m_formats[cls])
+            && _writeRgb(name1, w, h,
+                         reinterpret_cast<const char *>(&data[0].second),
+                         xStride, step * sizeof(CurveParam), m_formats[cls]);
+}
+
+bool ImageLoader::saveExr(const std::vector<int> &data, int w, int h,
+                          const std::string &name, ExrClass cls)
+{
+    std::vector<float> scaled = BufferPool::instance()->acquire(data.size(),
+                                                                "save");
+    ThreadPool::instance()->parallelFor(
+                data.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+            scaled[i] = data[i] / 100000.f;
+    });
+    bool ok = saveExr(scaled, w, h, name, cls);
+    BufferPool::instance()->release(scaled);
+    return ok;
+}
+
+namespace {
+// Raw cache layout: this header, then interleaved RGB float32 from byte 64
+struct RawHeader
+{
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    char reserved[44];
+};
+static_assert(sizeof(RawHeader) == 64, "raw data must stay aligned");
+const char rawMagic[8] = {'M', 'C', 'P', 'T', 'R', 'A', 'W', '1'};
+const char ckptMagic[8] = {'M', 'C', 'P', 'T', 'C', 'K', 'P', '1'};
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &name)
     {
-        for(int x = 0; x < w; x++)
+#ifdef _WIN32
+        m_file = CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                             nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                             nullptr);
+        if(m_file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return;
+
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0,
+                                       nullptr);
+        if(!m_mapping)
+            return;
+
+        m_data = static_cast<const char *>(MapViewOfFile(m_mapping,
+                                                         FILE_MAP_READ, 0, 0,
+                                                         0));
+        if(m_data)
+            m_size = size_t(size.QuadPart);
+#else
+        int fd = open(name.c_str(), O_RDONLY);
+        if(fd < 0)
+            return;
+
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
         {
-            pixels0[y][x] = Imf::Rgba(ptr->first,
-                                      (ptr + 1)->first,
-                                      (ptr + 2)->first);
-            pixels1[y][x] = Imf::Rgba(ptr->second,
-                                      (ptr + 1)->second,
-                                      (ptr + 2)->second);
-            ptr += 3;
+            void *ptr = mmap(nullptr, size_t(st.st_size), PROT_READ,
+                             MAP_PRIVATE, fd, 0);
+            if(ptr != MAP_FAILED)
+            {
+                m_data = static_cast<const char *>(ptr);
+                m_size = size_t(st.st_size);
+            }
         }
+        close(fd);
+#endif
     }
-    Imf::RgbaOutputFile file0(name0.c_str(), w, h, Imf::WRITE_RGB);
-    file0.setFrameBuffer(&pixels0[0][0], 1, size_t(w));
-    file0.writePixels(h);
-    Imf::RgbaOutputFile file1(name1.c_str(), w, h, Imf::WRITE_RGB);
-    file1.setFrameBuffer(&pixels1[0][0], 1, size_t(w));
-    file1.writePixels(h);
-    return true;
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if(m_data)
+            UnmapViewOfFile(m_data);
+        if(m_mapping)
+            CloseHandle(m_mapping);
+        if(m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if(m_data)
+            munmap(const_cast<char *>(m_data), m_size);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+};
 }
 
-bool ImageLoader::saveExr(const std::vector<int> &data, int w, int h,
+// Cached intermediates in full precision with no decoding: the mapped
+// pages go straight into a pooled buffer
+std::vector<float> ImageLoader::loadRaw(const std::string &fileName,
+                                        int &w, int &h)
+{
+    MappedFile file(fileName);
+    if(file.size() < sizeof(RawHeader))
+        return std::vector<float>();
+
+    RawHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    size_t len = 3 * size_t(header.width) * size_t(header.height);
+    if(std::memcmp(header.magic, rawMagic, sizeof(rawMagic)) != 0
+            || header.channels != 3
+            || file.size() != sizeof(RawHeader) + len * sizeof(float))
+    {
+        std::cerr << "Error reading " << fileName << ": not a raw cache"
+                  << std::endl;
+        return std::vector<float>();
+    }
+    std::vector<float> data = BufferPool::instance()->acquire(len, "load");
+    std::memcpy(data.data(), file.data() + sizeof(RawHeader),
+                len * sizeof(float));
+    w = int(header.width);
+    h = int(header.height);
+    return data;
+}
+
+bool ImageLoader::saveRaw(const std::vector<float> &data, int w, int h,
                           const std::string &name)
 {
-    const int *ptr = data.data();
-    Imf::Array2D<Imf::Rgba> pixels(h, w);
-    for(int y = 0; y < h; y++)
+    RawHeader header = {};
+    std::memcpy(header.magic, rawMagic, sizeof(rawMagic));
+    header.width = uint32_t(w);
+    header.height = uint32_t(h);
+    header.channels = 3;
+    std::ofstream file(name, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(data.data()),
+               std::streamsize(3 * size_t(w * h) * sizeof(float)));
+    if(!file)
+    {
+        std::cerr << "Error writing " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Curve checkpoint: a raw header with the level count in reserved[0..3],
+// the spp of each level, then each level's estimate
+bool ImageLoader::loadCheckpoint(const std::string &fileName, int &w, int &h,
+                                 std::vector<int> &spp,
+                                 std::vector<std::vector<float>> &vars)
+{
+    MappedFile file(fileName);
+    if(file.size() < sizeof(RawHeader))
+        return false;
+
+    RawHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    uint32_t count;
+    std::memcpy(&count, header.reserved, sizeof(count));
+    size_t len = size_t(header.channels) * size_t(header.width)
+            * size_t(header.height);
+    if(std::memcmp(header.magic, ckptMagic, sizeof(ckptMagic)) != 0
+            || file.size() != sizeof(RawHeader) + count * sizeof(int32_t)
+            + count * len * sizeof(float))
+    {
+        std::cerr << "Error reading " << fileName << ": not a checkpoint"
+                  << std::endl;
+        return false;
+    }
+    const char *ptr = file.data() + sizeof(RawHeader);
+    spp.resize(count);
+    for(uint32_t k = 0; k < count; k++)
+    {
+        int32_t n;
+        std::memcpy(&n, ptr, sizeof(n));
+        spp[k] = n;
+        ptr += sizeof(n);
+    }
+    vars.resize(count);
+    for(uint32_t k = 0; k < count; k++)
+    {
+        vars[k] = BufferPool::instance()->acquire(len, "checkpoint");
+        std::memcpy(vars[k].data(), ptr, len * sizeof(float));
+        ptr += len * sizeof(float);
+    }
+    w = int(header.width);
+    h = int(header.height);
+    return true;
+}
+
+// Writes the last count levels; the file is replaced only when complete
+bool ImageLoader::saveCheckpoint(const std::vector<int> &spp,
+                                 const std::vector<std::vector<float>> &vars,
+                                 size_t count, int w, int h,
+                                 const std::string &name)
+{
+    count = std::min(count, vars.size());
+    size_t first = vars.size() - count;
+    RawHeader header = {};
+    std::memcpy(header.magic, ckptMagic, sizeof(ckptMagic));
+    header.width = uint32_t(w);
+    header.height = uint32_t(h);
+    header.channels = count > 0 ? uint32_t(vars[first].size()
+                                           / size_t(w * h)) : 3;
+    uint32_t count32 = uint32_t(count);
+    std::memcpy(header.reserved, &count32, sizeof(count32));
+    std::string tmp = name + ".tmp";
     {
-        for(int x = 0; x < w; x++)
+        std::ofstream file(tmp, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for(size_t k = first; k < vars.size(); k++)
         {
-            pixels[y][x] = Imf::Rgba(
-                        ptr[0] / 100000.f,
-                        ptr[1] / 100000.f,
-                        ptr[2] / 100000.f);
-            ptr += 3;
+            int32_t n = spp[k];
+            file.write(reinterpret_cast<const char *>(&n), sizeof(n));
+        }
+        for(size_t k = first; k < vars.size(); k++)
+            file.write(reinterpret_cast<const char *>(vars[k].data()),
+                       std::streamsize(vars[k].size() * sizeof(float)));
+        if(!file)
+        {
+            std::cerr << "Error writing " << tmp << std::endl;
+            return false;
         }
     }
-    Imf::RgbaOutputFile file(name.c_str(), w, h, Imf::WRITE_RGB);
-    file.setFrameBuffer(&pixels[0][0], 1, size_t(w));
-    file.writePixels(h);
-    return true;
+    std::remove(name.c_str());
+    return std::rename(tmp.c_str(), name.c_str()) == 0;
 }
 
 namespace {
@@ -193,79 +517,77 @@ void ImageLoader::gaussianBlur(const std::vector<float> &src,
             weightSum += *kPtr++;
         }
     }
-    std::vector<float> res(src.size());
-    for(int y = 0; y < h; y++)
-    {
-        for(int x = 0; x < w; x++)
+    std::vector<float> res = BufferPool::instance()->acquire(src.size(),
+                                                             "blur");
+    ThreadPool::instance()->parallelFor(size_t(h), [&](size_t y0, size_t y1) {
+        for(int y = int(y0); y < int(y1); y++)
         {
-            float dstR = 0, dstG = 0, dstB = 0;
-            float *kPtr = kernel.data();
-            for(int ky = -halfKernel; ky <= halfKernel; ky++)
+            for(int x = 0; x < w; x++)
             {
-                for(int kx = -halfKernel; kx <= halfKernel; kx++)
+                float dstR = 0, dstG = 0, dstB = 0;
+                const float *kPtr = kernel.data();
+                for(int ky = -halfKernel; ky <= halfKernel; ky++)
                 {
-                    float weight = *kPtr++;
-                    int pixelX = clamp(x + kx, 0, w - 1);
-                    int pixelY = clamp(y + ky, 0, h - 1);
-                    size_t idx = size_t(pixelX + pixelY * w) * 3;
-                    float r = src[idx];
-                    float g = src[idx + 1];
-                    float b = src[idx + 2];
-                    if(!std::isnormal(r))
-                        r = 0;
-                    if(!std::isnormal(g))
-                        g = 0;
-                    if(!std::isnormal(b))
-                        b = 0;
-
-                    dstR += weight * r;
-                    dstG += weight * g;
-                    dstB += weight * b;
+                    for(int kx = -halfKernel; kx <= halfKernel; kx++)
+                    {
+                        float weight = *kPtr++;
+                        int pixelX = clamp(x + kx, 0, w - 1);
+                        int pixelY = clamp(y + ky, 0, h - 1);
+                        size_t idx = size_t(pixelX + pixelY * w) * 3;
+                        float r = src[idx];
+                        float g = src[idx + 1];
+                        float b = src[idx + 2];
+                        dstR += weight * r;
+                        dstG += weight * g;
+                        dstB += weight * b;
+                    }
                 }
+                size_t dstIdx = size_t(x + y * w) * 3;
+                res[dstIdx] = dstR / weightSum;
+                res[dstIdx + 1] = dstG / weightSum;
+                res[dstIdx + 2] = dstB / weightSum;
             }
-            size_t dstIdx = size_t(x + y * w) * 3;
-            res[dstIdx] = dstR / weightSum;
-            res[dstIdx + 1] = dstG / weightSum;
-            res[dstIdx + 2] = dstB / weightSum;
         }
-    }
-    dst = res;
+    }, 1);
+    dst.swap(res);
+    BufferPool::instance()->release(res);
 }
 
 float ImageLoader::mse(const std::vector<float> &img1,
                        const std::vector<float> &img2)
 {
     size_t len = std::min(img1.size(), img2.size());
-    std::vector<float> aux(len);
-    std::transform(img1.begin(), img1.begin() + int(len), img2.begin(),
-                   aux.begin(), [](float a, float b) {
-                       if(!std::isnormal(a)) a = 0;
-                       if(!std::isnormal(b)) b = 0;
-                       return (a - b) * (a - b);
-                   });
-    return avg(aux);
+    double s = ThreadPool::instance()->parallelReduce(
+                len, [&](size_t begin, size_t end) {
+        double part = 0;
+        for(size_t i = begin; i < end; i++)
+            part += (img1[i] - img2[i]) * (img1[i] - img2[i]);
+        return part;
+    });
+    return float(s / len);
 }
 
 float ImageLoader::avg(const std::vector<float> &img)
 {
-    float s = 0;
-    for(float val : img)
-        s += std::isnormal(val) ? val : 0.0f;
-
-    return s / img.size();
+    double s = ThreadPool::instance()->parallelReduce(
+                img.size(), [&](size_t begin, size_t end) {
+        double part = 0;
+        for(size_t i = begin; i < end; i++)
+            part += img[i];
+        return part;
+    });
+    return float(s / img.size());
 }
 
 std::vector<float> ImageLoader::mseVector(const std::vector<float> &img1,
                                           const std::vector<float> &img2)
 {
     size_t len = std::min(img1.size(), img2.size());
-    std::vector<float> aux(len);
-    std::transform(img1.begin(), img1.begin() + int(len), img2.begin(),
-                   aux.begin(), [](float a, float b) {
-                       if(!std::isnormal(a)) a = 0;
-                       if(!std::isnormal(b)) b = 0;
-                       return (a - b) * (a - b);
-                   });
+    std::vector<float> aux = BufferPool::instance()->acquire(len, "mse");
+    ThreadPool::instance()->parallelFor(len, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+            aux[i] = (img1[i] - img2[i]) * (img1[i] - img2[i]);
+    });
     return aux;
 }
 
@@ -273,16 +595,286 @@ std::vector<float> ImageLoader::diff(const std::vector<float> &img,
                                      const std::vector<float> &ref)
 {
     float mean = 0.05f;
-    std::vector<float> diffVec(std::min(img.size(), ref.size()), 0);
-    for(size_t i = 0; i < diffVec.size(); i += 3)
+    std::vector<float> diffVec = BufferPool::instance()->acquire(
+                std::min(img.size(), ref.size()), "diff");
+    ThreadPool::instance()->parallelFor(
+                diffVec.size() / 3, [&](size_t begin, size_t end) {
+        for(size_t i = 3 * begin; i < 3 * end; i += 3)
+        {
+            float rdiff = img[i] - ref[i];
+            float gdiff = img[i + 1] - ref[i + 1];
+            float bdiff = img[i + 2] - ref[i + 2];
+            float d = rdiff * rdiff + gdiff * gdiff + bdiff * bdiff;
+            diffVec[i] = d / mean;
+            diffVec[i + 1] = d / mean;
+            diffVec[i + 2] = d / mean;
+        }
+    });
+    return diffVec;
+}
+
+std::vector<float> ImageLoader::luminance(const std::vector<float> &img,
+                                          bool channelMax)
+{
+    std::vector<float> lum = BufferPool::instance()->acquire(img.size() / 3,
+                                                             "luminance");
+    ThreadPool::instance()->parallelFor(
+                lum.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+        {
+            float r = img[3 * i];
+            float g = img[3 * i + 1];
+            float b = img[3 * i + 2];
+
+            lum[i] = channelMax ? std::max(r, std::max(g, b))
+                                : 0.2126f * r + 0.7152f * g + 0.0722f * b;
+        }
+    });
+    return lum;
+}
+
+// Zero NaN/Inf (and negative values if nonNegative), return their count
+size_t ImageLoader::sanitize(std::vector<float> &img, bool nonNegative)
+{
+    double bad = ThreadPool::instance()->parallelReduce(
+                img.size(), [&](size_t begin, size_t end) {
+        size_t part = 0;
+        for(size_t i = begin; i < end; i++)
+        {
+            if(!std::isfinite(img[i]) || (nonNegative && img[i] < 0))
+            {
+                img[i] = 0;
+                part++;
+            }
+        }
+        return double(part);
+    });
+    return size_t(bad);
+}
+
+std::vector<float> ImageLoader::crop(const std::vector<float> &img,
+                                     int w, int h, int x, int y,
+                                     int cw, int ch)
+{
+    // Color, albedo and normal are stored one after another
+    size_t planeLen = 3 * size_t(w * h);
+    size_t planes = img.size() / planeLen;
+    size_t cropLen = 3 * size_t(cw * ch);
+    std::vector<float> res(planes * cropLen);
+    size_t rowLen = 3 * size_t(cw);
+    for(size_t p = 0; p < planes; p++)
     {
-        float rdiff = img[i] - ref[i];
-        float gdiff = img[i + 1] - ref[i + 1];
-        float bdiff = img[i + 2] - ref[i + 2];
-        float d = rdiff * rdiff + gdiff * gdiff + bdiff * bdiff;
-        diffVec[i] = d / mean;
-        diffVec[i + 1] = d / mean;
-        diffVec[i + 2] = d / mean;
+        for(int row = 0; row < ch; row++)
+        {
+            const float *src = img.data() + p * planeLen
+                    + 3 * (size_t(x) + size_t(y + row) * size_t(w));
+            std::copy(src, src + rowLen,
+                      res.begin() + long(p * cropLen + size_t(row) * rowLen));
+        }
+    }
+    return res;
+}
+
+void ImageLoader::paste(const std::vector<float> &src, int sw, int sx, int sy,
+                        std::vector<float> &dst, int w, int x, int y,
+                        int rw, int rh)
+{
+    size_t rowLen = 3 * size_t(rw);
+    for(int row = 0; row < rh; row++)
+    {
+        const float *srcRow = src.data()
+                + 3 * (size_t(sx) + size_t(sy + row) * size_t(sw));
+        std::copy(srcRow, srcRow + rowLen,
+                  dst.begin() + long(3 * (size_t(x)
+                                          + size_t(y + row) * size_t(w))));
+    }
+}
+
+// Mark (OR into dirty) the tiles where img differs from prev
+void ImageLoader::changedTiles(const std::vector<float> &img,
+                               const std::vector<float> &prev, int w, int h,
+                               int tile, std::vector<char> &dirty)
+{
+    int tilesX = (w + tile - 1) / tile;
+    int tilesY = (h + tile - 1) / tile;
+    dirty.resize(size_t(tilesX * tilesY), 0);
+    for(int y = 0; y < h; y++)
+    {
+        for(int tx = 0; tx < tilesX; tx++)
+        {
+            size_t t = size_t(tx + (y / tile) * tilesX);
+            if(dirty[t])
+                continue;
+
+            size_t idx = 3 * (size_t(tx * tile) + size_t(y) * size_t(w));
+            size_t rowLen = 3 * size_t(std::min(tile, w - tx * tile));
+            dirty[t] = !std::equal(img.begin() + long(idx),
+                                   img.begin() + long(idx + rowLen),
+                                   prev.begin() + long(idx));
+        }
+    }
+}
+
+// Tiles with any variance above the threshold; the rest are converged
+// or background
+void ImageLoader::activeTiles(const std::vector<float> &var, int w, int h,
+                              int tile, float threshold,
+                              std::vector<char> &active)
+{
+    int tilesX = (w + tile - 1) / tile;
+    int tilesY = (h + tile - 1) / tile;
+    active.assign(size_t(tilesX * tilesY), 0);
+    ThreadPool::instance()->parallelFor(
+                size_t(tilesY), [&](size_t begin, size_t end) {
+        for(int ty = int(begin); ty < int(end); ty++)
+        {
+            for(int y = ty * tile; y < std::min((ty + 1) * tile, h); y++)
+            {
+                for(int tx = 0; tx < tilesX; tx++)
+                {
+                    size_t t = size_t(tx + ty * tilesX);
+                    if(active[t])
+                        continue;
+
+                    size_t idx = 3 * (size_t(tx * tile)
+                                      + size_t(y) * size_t(w));
+                    size_t rowLen = 3 * size_t(std::min(tile, w - tx * tile));
+                    active[t] = std::any_of(var.begin() + long(idx),
+                                            var.begin() + long(idx + rowLen),
+                                            [threshold](float v) {
+                        return v > threshold;
+                    });
+                }
+            }
+        }
+    }, 1);
+}
+
+// Moments of n samples per pixel, either raw sums (sum, sum of squares)
+// or Welford state (mean, M2); both come out as mean and M2
+bool ImageLoader::loadMoments(const std::string &name0,
+                              const std::string &name1, int n, bool welford,
+                              int &w, int &h, std::vector<float> &mean,
+                              std::vector<float> &m2)
+{
+    mean = _loadFloat(name0, w, h);
+    if(mean.empty() || n < 1)
+        return false;
+
+    m2 = _loadFloat(name1, w, h);
+    if(m2.size() != mean.size())
+    {
+        BufferPool::instance()->release({&mean, &m2});
+        return false;
+    }
+    size_t bad = size_t(ThreadPool::instance()->parallelReduce(
+                mean.size(), [&](size_t begin, size_t end) {
+        size_t part = 0;
+        for(size_t i = begin; i < end; i++)
+        {
+            if(!std::isfinite(mean[i]) || !std::isfinite(m2[i]))
+            {
+                mean[i] = m2[i] = 0;
+                part++;
+                continue;
+            }
+            if(!welford)
+            {
+                // M2 = S2 - S1 * S1 / n, clamped against cancellation
+                float sum = mean[i];
+                mean[i] = sum / n;
+                m2[i] = m2[i] - sum * mean[i];
+            }
+            m2[i] = std::max(m2[i], 0.0f);
+        }
+        return double(part);
+    }));
+    if(bad > 0)
+        std::cerr << "Sanitized " << bad << " values in " << name0
+                  << std::endl;
+
+    return true;
+}
+
+// Chan et al. parallel update: fold n2 new samples into n old ones
+void ImageLoader::mergeMoments(std::vector<float> &mean,
+                               std::vector<float> &m2, int n,
+                               const std::vector<float> &mean2,
+                               const std::vector<float> &m22, int n2)
+{
+    float total = float(n + n2);
+    float f = float(n2) / total;
+    float g = float(n) * float(n2) / total;
+    ThreadPool::instance()->parallelFor(
+                mean.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+        {
+            float delta = mean2[i] - mean[i];
+            mean[i] += delta * f;
+            m2[i] += m22[i] + delta * delta * g;
+        }
+    });
+}
+
+// Image and variance of the mean in one pass over the moments
+void ImageLoader::fromMoments(const std::vector<float> &mean,
+                              const std::vector<float> &m2, int n,
+                              std::vector<float> &img,
+                              std::vector<float> &var)
+{
+    BufferPool *pool = BufferPool::instance();
+    img = pool->acquire(mean.size(), "load");
+    var = pool->acquire(mean.size(), "load");
+    float scale = n > 1 ? 1.0f / (float(n) * float(n - 1)) : 0.0f;
+    ThreadPool::instance()->parallelFor(
+                mean.size(), [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; i++)
+        {
+            img[i] = mean[i];
+            var[i] = m2[i] * scale;
+        }
+    });
+}
+
+// Full-precision RGB; sums of squares overflow half floats
+std::vector<float> ImageLoader::_loadFloat(const std::string &fileName,
+                                           int &w, int &h)
+{
+    if(!std::ifstream(fileName))
+        return std::vector<float>();
+
+    try {
+        Imf::InputFile file(fileName.c_str());
+        Imath::Box2i dw = file.header().dataWindow();
+        int width = dw.max.x - dw.min.x + 1;
+        int height = dw.max.y - dw.min.y + 1;
+
+        size_t len = size_t(3 * width * height);
+        std::vector<float> data = BufferPool::instance()->acquire(len, "load");
+        char *base = reinterpret_cast<char *>(data.data()
+                                              - 3 * (dw.min.x
+                                                     + dw.min.y * width));
+        size_t xStride = 3 * sizeof(float);
+        size_t yStride = xStride * size_t(width);
+        Imf::FrameBuffer frameBuffer;
+        frameBuffer.insert("R", Imf::Slice(Imf::FLOAT, base, xStride,
+                                           yStride));
+        frameBuffer.insert("G", Imf::Slice(Imf::FLOAT, base + sizeof(float),
+                                           xStride, yStride));
+        frameBuffer.insert("B", Imf::Slice(Imf::FLOAT,
+                                           base + 2 * sizeof(float),
+                                           xStride, yStride));
+        file.setFrameBuffer(frameBuffer);
+        file.readPixels(dw.min.y, dw.max.y);
+
+        w = width;
+        h = height;
+        return data;
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error reading " << fileName << ": " << e.what()
+                  << std::endl;
+        return std::vector<float>();
     }
-    return diffVec;
 }
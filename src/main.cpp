@@ -10,23 +10,548 @@
 #include <algorithm>
 #include <cmath>
 #include <filesystem>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <future>
+#include <cstdio>
 #include "imageloader.h"
 #include "curvepredictor.h"
 #include "imagedenoiser.h"
+#include "stagescheduler.h"
+#include "bufferpool.h"
+#include "threadpool.h"
+#include "imagecache.h"
+#include "tilesharder.h"
 
-int main(int argc, char *argv[])
+namespace {
+// Products selected with --outputs
+enum Output
+{
+    OutBlended = 1,
+    OutWeights = 2,
+    OutCurves = 4,
+    OutDiff = 8,
+    OutMse = 16,
+    OutAll = 31
+};
+
+struct Options
 {
     bool useAlbedo = true;
     bool useNormal = true;
     bool applyGB = true;
     bool useOptiX = false;
+    bool useATrous = false;
+    bool estATrous = false;
     int denoiseUntil = -1;
     bool recalcAll = false;
-    // Gaussian Blur
-    const int winSize = 11;
+    float budgetTarget = -1;
+    float stopTarget = -1;
+    float sureFraction = -1;
+    bool checkSure = false;
+    bool useLuminance = false;
+    bool channelMax = false;
+    float timeBudget = -1;
+    bool memReport = false;
+    int denoiserThreads = 0;
+    bool denoiserAffinity = true;
+    bool useCuda = false;
+    bool incremental = false;
+    float sparseThreshold = -1;
+    bool moments = false;
+    bool momentDeltas = false;
+    bool rawCache = false;
+    int curveBlock = 0;
+    bool preview = false;
+    int imageCacheMb = 0;
+    bool checkpoint = false;
+    bool warmStart = false;
+    int shardTile = 0;
+    int shardWorkers = 2;
+    // Set by -sh for its workers
+    std::string frameStats;
+    bool statsPass = false;
+    int levelsInFlight = 2;
+    unsigned outputs = OutAll;
+};
+
+bool parseExrFormat(const std::string &cls, const std::string &compression,
+                    int bits, ImageLoader::ExrClass &exrClass,
+                    ImageLoader::ExrFormat &format)
+{
+    const char *classes[] = {"intermediate", "debug", "delivered"};
+    const char *compressions[] = {"none", "rle", "zips", "zip", "piz",
+                                  "dwaa"};
+    int k = 0;
+    while(k < 3 && cls != classes[k])
+        k++;
+    int c = 0;
+    while(c < 6 && compression != compressions[c])
+        c++;
+    if(k == 3 || c == 6 || (bits != 16 && bits != 32))
+        return false;
+
+    exrClass = ImageLoader::ExrClass(k);
+    format.compression = ImageLoader::Compression(c);
+    format.half = bits == 16;
+    return true;
+}
+
+bool parseOutputs(const std::string &arg, unsigned &outputs)
+{
+    const char *names[] = {"blended", "weights", "curves", "diff", "mse"};
+    outputs = 0;
+    std::stringstream ss(arg);
+    std::string item;
+    while(std::getline(ss, item, ','))
+    {
+        size_t k = 0;
+        while(k < 5 && item != names[k])
+            k++;
+        if(k == 5)
+            return false;
+
+        outputs |= 1u << k;
+    }
+    return true;
+}
+
+// Write next to the target and rename, so viewers never see a partial file
+bool publish(const std::vector<float> &data, int w, int h,
+             const std::string &name)
+{
+    std::string tmp = name + ".tmp";
+    if(!ImageLoader::saveExr(data, w, h, tmp, ImageLoader::Delivered))
+        return false;
+
+    std::remove(name.c_str());
+    return std::rename(tmp.c_str(), name.c_str()) == 0;
+}
+
+// Intermediates go to raw float files with -rc, to EXR otherwise
+std::vector<float> loadCache(const std::string &name, bool raw, int &w,
+                             int &h, bool nonNegative = false)
+{
+    return raw ? ImageLoader::loadRaw(name, w, h)
+               : ImageLoader::loadImage(name, w, h, nonNegative);
+}
+
+// Tile-wise results (-i, -sp) only approximate full frames, so they are
+// cached under their own name: name.exr becomes name.inc.exr
+std::string tileCache(const std::string &name, const std::string &tag)
+{
+    size_t dot = name.find_last_of('.');
+    return name.substr(0, dot) + tag + name.substr(dot);
+}
+
+bool saveCache(const std::vector<float> &data, int w, int h,
+               const std::string &name, bool raw)
+{
+    return raw ? ImageLoader::saveRaw(data, w, h, name)
+               : ImageLoader::saveExr(data, w, h, name);
+}
+
+// Running per-pixel moments of all samples read so far (-w)
+struct MomentState
+{
+    std::vector<float> mean, m2;
+    int n = 0;
+};
+
+// Reads a level's raw sums (.sum/.sum2) or Welford state (.mean/.m2);
+// with deltas the buffers hold only samples added since the last level
+bool readMoments(const std::string &base, int spp, bool deltas,
+                 MomentState &state, int &w, int &h)
+{
+    int n = deltas ? spp - state.n : spp;
+    std::vector<float> mean, m2;
+    if(!ImageLoader::loadMoments(base + "spp.sum.exr", base + "spp.sum2.exr",
+                                 n, false, w, h, mean, m2)
+            && !ImageLoader::loadMoments(base + "spp.mean.exr",
+                                         base + "spp.m2.exr", n, true, w, h,
+                                         mean, m2))
+        return false;
+
+    if(deltas && state.n > 0)
+        ImageLoader::mergeMoments(state.mean, state.m2, state.n, mean, m2, n);
+    else
+    {
+        state.mean.swap(mean);
+        state.m2.swap(m2);
+    }
+    BufferPool::instance()->release({&mean, &m2});
+    state.n = spp;
+    return true;
+}
+
+// Tiles for incremental recompute (-i); the halo gives crops context
+const int incTile = 64;
+const int incHalo = 32;
+
+// Grow the dirty tiles by one so results near their borders are redone
+std::vector<char> dilateTiles(const std::vector<char> &dirty, int w, int h)
+{
+    int tilesX = (w + incTile - 1) / incTile;
+    int tilesY = (h + incTile - 1) / incTile;
+    std::vector<char> res(dirty.size(), 0);
+    for(int ty = 0; ty < tilesY; ty++)
+    {
+        for(int tx = 0; tx < tilesX; tx++)
+        {
+            if(!dirty[size_t(tx + ty * tilesX)])
+                continue;
+
+            for(int y = std::max(ty - 1, 0); y <= std::min(ty + 1, tilesY - 1);
+                y++)
+            {
+                for(int x = std::max(tx - 1, 0);
+                    x <= std::min(tx + 1, tilesX - 1); x++)
+                    res[size_t(x + y * tilesX)] = 1;
+            }
+        }
+    }
+    return res;
+}
+
+std::vector<char> pixelMask(const std::vector<char> &dirty, int w, int h)
+{
+    int tilesX = (w + incTile - 1) / incTile;
+    std::vector<char> mask(size_t(w * h), 0);
+    for(int y = 0; y < h; y++)
+    {
+        for(int x = 0; x < w; x++)
+            mask[size_t(x + y * w)] = dirty[size_t(x / incTile
+                                                   + (y / incTile) * tilesX)];
+    }
+    return mask;
+}
+
+// Recompute the dirty tiles of dst, which holds the previous level's
+// result, from crops with a halo; clean tiles keep their values
+void updateTiles(const std::vector<char> &dirty, int w, int h,
+                 std::vector<float> &dst,
+                 const std::function<void(int, int, int, int,
+                                          std::vector<float> &)> &stage)
+{
+    int tilesX = (w + incTile - 1) / incTile;
+    int cw = std::min(w, incTile + 2 * incHalo);
+    int ch = std::min(h, incTile + 2 * incHalo);
+    std::vector<float> res;
+    for(size_t t = 0; t < dirty.size(); t++)
+    {
+        if(!dirty[t])
+            continue;
+
+        int x0 = int(t % size_t(tilesX)) * incTile;
+        int y0 = int(t / size_t(tilesX)) * incTile;
+        int cx = std::min(std::max(x0 - incHalo, 0), w - cw);
+        int cy = std::min(std::max(y0 - incHalo, 0), h - ch);
+        stage(cx, cy, cw, ch, res);
+        ImageLoader::paste(res, cw, x0 - cx, y0 - cy, dst, w, x0, y0,
+                           std::min(incTile, w - x0),
+                           std::min(incTile, h - y0));
+    }
+}
+
+bool matchWildcard(const char *pattern, const char *name)
+{
+    if(*pattern == '\0')
+        return *name == '\0';
+
+    if(*pattern == '*')
+        return matchWildcard(pattern + 1, name)
+                || (*name != '\0' && matchWildcard(pattern, name + 1));
+
+    if(*name != '\0' && (*pattern == '?' || *pattern == *name))
+        return matchWildcard(pattern + 1, name + 1);
+
+    return false;
+}
+
+// Directory holding a frame directory, for files shared by the shot;
+// relative names and trailing separators are resolved first
+std::string shotDir(const std::string &frame)
+{
+    namespace fs = std::experimental::filesystem;
+    std::string dir = fs::absolute(fs::path(frame)).string();
+    while(dir.length() > 1 && (dir.back() == '/' || dir.back() == '\\'))
+        dir.pop_back();
+    std::string parent = fs::path(dir).parent_path().string();
+    return parent.empty() ? "." : parent;
+}
+
+// Frame directories: a single directory, a glob in the last path
+// component or @LIST, a text file with one directory per line
+std::vector<std::string> framePaths(const std::string &arg)
+{
+    namespace fs = std::experimental::filesystem;
+    std::vector<std::string> paths;
+    if(!arg.empty() && arg[0] == '@')
+    {
+        std::ifstream list(arg.substr(1));
+        std::string line;
+        while(std::getline(list, line))
+        {
+            line.erase(line.find_last_not_of(" \t\r") + 1);
+            if(!line.empty())
+                paths.push_back(line);
+        }
+        return paths;
+    }
+    fs::path p(arg);
+    std::string pattern = p.filename().string();
+    if(pattern.find_first_of("*?") == std::string::npos)
+    {
+        paths.push_back(arg);
+        return paths;
+    }
+    fs::path dir = p.has_parent_path() ? p.parent_path() : fs::path(".");
+    for(const auto &entry : fs::directory_iterator(dir))
+    {
+        std::string name = entry.path().filename().string();
+        if(fs::is_directory(entry.status())
+                && matchWildcard(pattern.c_str(), name.c_str()))
+            paths.push_back(entry.path().string());
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+// Empty for full quality, so those cache names stay as they were
+std::string qualityTag(ImageDenoiser::Quality quality)
+{
+    return quality == ImageDenoiser::Balanced ? ".balanced" : "";
+}
+
+double elapsedMs(const std::chrono::steady_clock::time_point &t0)
+{
+    return std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t0).count();
+}
+
+// Denoise stage time without the wait for other frames' runs
+double denoiseMs(const std::chrono::steady_clock::time_point &t0,
+                 double waited)
+{
+    return elapsedMs(t0) - (ImageDenoiser::instance()->waitedMs() - waited);
+}
+
+int processFrame(const std::string &path, const Options &opt,
+                 StageScheduler &scheduler, std::ostream &out,
+                 const std::string &prevPath = std::string());
+
+// Curves of the last level of the previous frame (-tw), moved along the
+// motion vectors of this frame: R and G of NAME.motion.exr hold the
+// offset in pixels to where each pixel was in the previous frame
+std::vector<CurveParam> loadSeed(const std::string &prevPath,
+                                 const std::string &path,
+                                 const std::string &fileName, int w, int h,
+                                 std::ostream &out)
+{
+    namespace fs = std::experimental::filesystem;
+    std::string slopeName;
+    for(const auto &entry : fs::directory_iterator(prevPath))
+    {
+        std::string name = entry.path().filename().string();
+        if(ImageLoader::endsWith(name, "spp.slope.exr") && name > slopeName)
+            slopeName = name;
+    }
+    std::vector<CurveParam> seed;
+    if(slopeName.empty())
+    {
+        out << "No curves in " << prevPath << " to start from" << std::endl;
+        return seed;
+    }
+    std::string slopePath = prevPath + "/" + slopeName;
+    std::string interceptPath = slopePath.substr(0, slopePath.length() - 9)
+            + "intercept.exr";
+    int sw = 0, sh = 0;
+    seed = ImageLoader::loadCurves(slopePath, interceptPath, sw, sh);
+    if(seed.empty() || sw != w || sh != h)
+    {
+        out << "Curves in " << prevPath << " do not fit" << std::endl;
+        seed.clear();
+        return seed;
+    }
+    int mw = 0, mh = 0;
+    std::string motionPath = path + "/" + fileName + ".motion.exr";
+    std::vector<float> motion = ImageLoader::loadImage(motionPath, mw, mh);
+    if(motion.empty() || mw != w || mh != h)
+        return seed;
+
+    std::vector<CurveParam> moved(seed.size(), CurveParam(.0f, .0f));
+    ThreadPool::instance()->parallelFor(
+                size_t(h), [&](size_t y0, size_t y1) {
+        for(int y = int(y0); y < int(y1); y++)
+        {
+            for(int x = 0; x < w; x++)
+            {
+                size_t p = size_t(x + y * w);
+                int px = int(std::lround(x + motion[3 * p]));
+                int py = int(std::lround(y + motion[3 * p + 1]));
+                // Newly visible pixels have no seed
+                if(px < 0 || px >= w || py < 0 || py >= h)
+                    continue;
+
+                size_t q = size_t(px + py * w);
+                for(size_t c = 0; c < 3; c++)
+                    moved[3 * p + c] = seed[3 * q + c];
+            }
+        }
+    }, 1);
+    BufferPool::instance()->release(motion);
+    return moved;
+}
+
+// Context a shard's denoiser and blurs see across the tile border
+const int shardHalo = 64;
+
+// Coordinator (-sh): worker processes run this tool on tile crops of the
+// frame, whose outputs are stitched back to full frames
+// Means over the whole frame, so shards decide steps 4, 8, 9 and 11a as
+// the unsharded frame would
+struct LevelStats
+{
+    float avgVar;
+    float avgSure;
+};
+
+// One line per level: spp, mean VAR, mean SURE
+bool loadFrameStats(const std::string &name, std::map<int, LevelStats> &stats)
+{
+    std::ifstream file(name);
+    if(!file)
+        return false;
+
+    int levelSpp;
+    LevelStats level;
+    while(file >> levelSpp >> level.avgVar >> level.avgSure)
+        stats[levelSpp] = level;
+    return !stats.empty();
+}
+
+bool saveFrameStats(const std::string &name,
+                    const std::map<int, LevelStats> &stats)
+{
+    std::ofstream file(name);
+    file.precision(9);
+    for(const auto &level : stats)
+        file << level.first << " " << level.second.avgVar << " "
+             << level.second.avgSure << std::endl;
+    return bool(file);
+}
+
+int shardFrame(const std::string &path, const Options &opt,
+               const std::string &program, const std::string &args,
+               std::ostream &out)
+{
+    TileSharder sharder(path, opt.shardTile, shardHalo);
+    if(!sharder.split(out))
+        return -1;
+
+    // Mean VAR of every level from the whole inputs; SURE is not known yet
+    std::map<int, LevelStats> stats;
+    std::vector<std::string> bases;
+    for(const std::string &name : sharder.inputs())
+    {
+        if(name.find("spp.var.exr") == std::string::npos)
+            continue;
+
+        int w = 0, h = 0;
+        std::vector<float> var = ImageLoader::loadImage(path + "/" + name, w,
+                                                        h, true);
+        if(var.empty())
+        {
+            out << "Error loading " << path << "/" << name << std::endl;
+            return -1;
+        }
+        std::string base = name.substr(0, name.length() - 11); // name_NNNNNN
+        bases.push_back(base);
+        stats[std::stoi(base.substr(base.length() - 6))] =
+                LevelStats{ImageLoader::avg(var), 0.0f};
+        BufferPool::instance()->release(var);
+    }
+    std::string statsPath = path + "/shards/frame.stats";
+    std::string statsArg = " -fs \"" + statsPath + "\"";
+    // 1. Workers denoise, blur and cache, and write SURE for its mean
+    bool ok = saveFrameStats(statsPath, stats)
+            && sharder.run(program, args + (opt.recalcAll ? " -c" : "")
+                           + statsArg + " -fp", opt.shardWorkers, out);
+    for(size_t k = 0; ok && k < bases.size(); k++)
+    {
+        std::vector<float> sure = sharder.gather(bases[k] + "spp.sure.exr",
+                                                 true);
+        if(sure.empty())
+        {
+            out << "No SURE of " << bases[k] << "spp in the shards"
+                << std::endl;
+            ok = false;
+            break;
+        }
+        int levelSpp = std::stoi(bases[k].substr(bases[k].length() - 6));
+        stats[levelSpp].avgSure = ImageLoader::avg(sure);
+        BufferPool::instance()->release(sure);
+    }
+    // 2. Curves, weights and blends from the cached DEN and SURE
+    ok = ok && saveFrameStats(statsPath, stats)
+            && sharder.run(program, args + statsArg, opt.shardWorkers, out);
+    std::vector<std::string> stitched = sharder.stitch(out);
+    if(!(opt.outputs & OutMse))
+        return ok ? 0 : -1;
+
+    std::string refName;
+    for(const std::string &name : sharder.inputs())
+    {
+        if(name.find("spp.hdr.exr") != std::string::npos)
+            refName = name;
+    }
+    int w = 0, h = 0;
+    std::vector<float> ref = ImageLoader::loadImage(path + "/" + refName, w,
+                                                    h);
+    if(ref.empty())
+    {
+        out << "Error loading " << path << "/" << refName << std::endl;
+        return -1;
+    }
+    out << "\tOURS\t\tMC" << std::endl;
+    for(const std::string &name : stitched)
+    {
+        // Blends only; their diff maps share the name
+        size_t pos = name.find("spp.ours.");
+        if(pos == std::string::npos
+                || name.find(".diff.") != std::string::npos)
+            continue;
+
+        std::vector<float> blended = ImageLoader::loadImage(path + "/" + name,
+                                                            w, h);
+        std::vector<float> img = ImageLoader::loadImage(
+                    path + "/" + name.substr(0, pos) + "spp.hdr.exr", w, h);
+        out << name.substr(pos - 6, 6) << "\t"
+            << ImageLoader::mse(blended, ref) << "\t"
+            << ImageLoader::mse(img, ref) << std::endl;
+        BufferPool::instance()->release({&blended, &img});
+    }
+    BufferPool::instance()->release(ref);
+    return ok ? 0 : -1;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    int framesInFlight = 2;
+    int numThreads = 0;
     if(argc < 2)
     {
         std::cout << "[MCPTBlender] <PATH_TO_HDR>" << std::endl;
+        std::cout << "   PATH_TO_HDR may be a glob (shot/frame_*) or "
+                     "@LIST of frame directories" << std::endl;
         goto help;
     }
     for(int i = 2; i < argc; i++)
@@ -36,36 +561,937 @@ int main(int argc, char *argv[])
 help:
             std::cout << "   -x          use optiX (default OIDN)"
                       << std::endl;
+            std::cout << "   -xa         use built-in a-trous filter "
+                         "(default OIDN)" << std::endl;
             std::cout << "   -a-         do not use albedo+normal "
                          "(default true)" << std::endl;
             std::cout << "   -n-         do not use normal "
                          "(default true)" << std::endl;
             std::cout << "   -o          apply OIDN on estimates "
                          "(default Gaussian blur)" << std::endl;
+            std::cout << "   -oa         apply a-trous filter on estimates "
+                         "(default Gaussian blur)" << std::endl;
             std::cout << "   -u N        denoise until N "
                          "(default last)" << std::endl;
             std::cout << "   -c          recalculate all "
                          "(default read from file if exists)" << std::endl;
+            std::cout << "   -b E        write per-pixel sample budget "
+                         "for target relMSE E (default off)" << std::endl;
+            std::cout << "   -e E        recommend stop spp for target "
+                         "mean relMSE E (default off)" << std::endl;
+            std::cout << "   -s F        SURE on fraction F of tiles "
+                         "(default full resolution)" << std::endl;
+            std::cout << "   -sc         compare tiled SURE with full "
+                         "resolution (default false)" << std::endl;
+            std::cout << "   -l          one curve per pixel on luminance "
+                         "(default per channel)" << std::endl;
+            std::cout << "   -lm         one curve per pixel on channel "
+                         "max (default per channel)" << std::endl;
+            std::cout << "   -T MS       pick quality, probes and estimate "
+                         "filter for MS ms per spp level (default off)"
+                      << std::endl;
+            std::cout << "   -g          run OIDN on a CUDA device if "
+                         "available (default CPU)" << std::endl;
+            std::cout << "   -dt N       OIDN CPU worker threads "
+                         "(default all cores)" << std::endl;
+            std::cout << "   -da-        do not pin OIDN threads to cores "
+                         "(default pinned)" << std::endl;
+            std::cout << "   -i          recompute only tiles that changed "
+                         "since the previous level (default false)"
+                      << std::endl;
+            std::cout << "   -sp T       skip tiles whose variance stays at "
+                         "or below T (default off)" << std::endl;
+            std::cout << "   -w          read moment buffers (.sum/.sum2 or "
+                         ".mean/.m2) instead of HDR and VAR (default false)"
+                      << std::endl;
+            std::cout << "   -wd         moment buffers hold only the samples "
+                         "added since the previous level (default false)"
+                      << std::endl;
+            std::cout << "   -cb N       fit curves per N x N block and "
+                         "interpolate (default per pixel)" << std::endl;
+            std::cout << "   -pv         publish a preview blended with the "
+                         "previous level's weights (default false)"
+                      << std::endl;
+            std::cout << "   -rc         cache intermediates as raw float "
+                         "files instead of EXR (default false)" << std::endl;
+            std::cout << "   -lc MB      keep up to MB of the -u level's "
+                         "HDR and VAR for later levels (default 0, off)"
+                      << std::endl;
+            std::cout << "   -ck         checkpoint the curve fit after each "
+                         "level and resume from it (default false)"
+                      << std::endl;
+            std::cout << "   -tw         seed curves from the previous "
+                         "frame's slope/intercept, reprojected by "
+                         "NAME.motion.exr if present (default false)"
+                      << std::endl;
+            std::cout << "   -sh N       split the frame into N x N tiles "
+                         "run by worker processes (default off)" << std::endl;
+            std::cout << "   -sn N       worker processes for -sh "
+                         "(default 2)" << std::endl;
+            std::cout << "   -fs FILE    -sh worker: frame-wide mean VAR "
+                         "and SURE per level" << std::endl;
+            std::cout << "   -fp         -sh worker: only write SURE for "
+                         "the frame-wide means" << std::endl;
+            std::cout << "   --outputs L comma-separated blended,weights,"
+                         "curves,diff,mse (default all); without diff and "
+                         "mse the reference is not read" << std::endl;
+            std::cout << "   -ex C Z B   EXR encoding of class C "
+                         "(intermediate, debug, delivered): compression Z "
+                         "(none, rle, zips, zip, piz, dwaa), B 16 or 32 bits "
+                         "(default none/zip/piz, 16)" << std::endl;
+            std::cout << "   -m          report peak memory and buffer "
+                         "allocations (default false)" << std::endl;
+            std::cout << "   -P N        frames processed at once in batch "
+                         "mode (default 2)" << std::endl;
+            std::cout << "   -L N        spp levels denoised at once before "
+                         "the serial curve fit (default 2);" << std::endl;
+            std::cout << "               -i, -w and -pv carry state between "
+                         "levels and run them one by one" << std::endl;
+            std::cout << "   -j N        threads for per-pixel work "
+                         "(default all cores)" << std::endl;
             std::cout << "   /?          show this help" << std::endl;
             return 0;
         }
         if(std::string(argv[i]) == "-x")
-            useOptiX = true;
+            opt.useOptiX = true;
+        else if(std::string(argv[i]) == "-xa")
+            opt.useATrous = true;
         else if(std::string(argv[i]) == "-a-")
         {
-            useAlbedo = false;
-            useNormal = false;
+            opt.useAlbedo = false;
+            opt.useNormal = false;
         }
         else if(std::string(argv[i]) == "-n-")
-            useNormal = false;
+            opt.useNormal = false;
         else if(std::string(argv[i]) == "-o")
-            applyGB = false;
+            opt.applyGB = false;
+        else if(std::string(argv[i]) == "-oa")
+        {
+            opt.applyGB = false;
+            opt.estATrous = true;
+        }
         else if(std::string(argv[i]) == "-u" && i < argc - 1)
-            denoiseUntil = std::stoi(argv[i + 1]);
+            opt.denoiseUntil = std::stoi(argv[i + 1]);
         else if(std::string(argv[i]) == "-c")
-            recalcAll = true;
+            opt.recalcAll = true;
+        else if(std::string(argv[i]) == "-b" && i < argc - 1)
+            opt.budgetTarget = std::stof(argv[i + 1]);
+        else if(std::string(argv[i]) == "-e" && i < argc - 1)
+            opt.stopTarget = std::stof(argv[i + 1]);
+        else if(std::string(argv[i]) == "-s" && i < argc - 1)
+            opt.sureFraction = std::stof(argv[i + 1]);
+        else if(std::string(argv[i]) == "-sc")
+            opt.checkSure = true;
+        else if(std::string(argv[i]) == "-l")
+            opt.useLuminance = true;
+        else if(std::string(argv[i]) == "-lm")
+        {
+            opt.useLuminance = true;
+            opt.channelMax = true;
+        }
+        else if(std::string(argv[i]) == "-T" && i < argc - 1)
+            opt.timeBudget = std::stof(argv[i + 1]);
+        else if(std::string(argv[i]) == "-g")
+            opt.useCuda = true;
+        else if(std::string(argv[i]) == "-dt" && i < argc - 1)
+            opt.denoiserThreads = std::stoi(argv[i + 1]);
+        else if(std::string(argv[i]) == "-da-")
+            opt.denoiserAffinity = false;
+        else if(std::string(argv[i]) == "-i")
+            opt.incremental = true;
+        else if(std::string(argv[i]) == "-sp" && i < argc - 1)
+            opt.sparseThreshold = std::max(std::stof(argv[i + 1]), 0.0f);
+        else if(std::string(argv[i]) == "-w")
+            opt.moments = true;
+        else if(std::string(argv[i]) == "-wd")
+            opt.moments = opt.momentDeltas = true;
+        else if(std::string(argv[i]) == "-cb" && i < argc - 1)
+            opt.curveBlock = std::max(std::stoi(argv[i + 1]), 0);
+        else if(std::string(argv[i]) == "-pv")
+            opt.preview = true;
+        else if(std::string(argv[i]) == "-rc")
+            opt.rawCache = true;
+        else if(std::string(argv[i]) == "-lc" && i < argc - 1)
+            opt.imageCacheMb = std::max(std::stoi(argv[i + 1]), 0);
+        else if(std::string(argv[i]) == "-ck")
+            opt.checkpoint = true;
+        else if(std::string(argv[i]) == "-tw")
+            opt.warmStart = true;
+        else if(std::string(argv[i]) == "-sh" && i < argc - 1)
+            opt.shardTile = std::max(std::stoi(argv[i + 1]), 0);
+        else if(std::string(argv[i]) == "-sn" && i < argc - 1)
+            opt.shardWorkers = std::max(std::stoi(argv[i + 1]), 1);
+        else if(std::string(argv[i]) == "-fs" && i < argc - 1)
+            opt.frameStats = argv[i + 1];
+        else if(std::string(argv[i]) == "-fp")
+            opt.statsPass = true;
+        else if(std::string(argv[i]) == "--outputs" && i < argc - 1)
+        {
+            if(!parseOutputs(argv[i + 1], opt.outputs))
+            {
+                std::cout << "Unknown output in " << argv[i + 1]
+                          << std::endl;
+                return -1;
+            }
+        }
+        else if(std::string(argv[i]) == "-ex" && i < argc - 3)
+        {
+            ImageLoader::ExrClass exrClass;
+            ImageLoader::ExrFormat format;
+            if(!parseExrFormat(argv[i + 1], argv[i + 2],
+                               std::stoi(argv[i + 3]), exrClass, format))
+            {
+                std::cout << "Unknown EXR encoding " << argv[i + 1] << " "
+                          << argv[i + 2] << " " << argv[i + 3] << std::endl;
+                return -1;
+            }
+            ImageLoader::setExrFormat(exrClass, format);
+        }
+        else if(std::string(argv[i]) == "-m")
+            opt.memReport = true;
+        else if(std::string(argv[i]) == "-P" && i < argc - 1)
+            framesInFlight = std::max(std::stoi(argv[i + 1]), 1);
+        else if(std::string(argv[i]) == "-L" && i < argc - 1)
+            opt.levelsInFlight = std::max(std::stoi(argv[i + 1]), 1);
+        else if(std::string(argv[i]) == "-j" && i < argc - 1)
+            numThreads = std::max(std::stoi(argv[i + 1]), 0);
+    }
+    std::vector<std::string> paths = framePaths(argv[1]);
+    if(paths.empty())
+    {
+        std::cout << "No frame directory found!" << std::endl;
+        return -1;
+    }
+    // Stage timings are shared by the frames of a shot
+    std::string timingsPath = shotDir(paths[0]) + "/MCPTBlender.timings";
+    StageScheduler scheduler(opt.timeBudget);
+    if(opt.timeBudget > 0)
+        scheduler.load(timingsPath);
+
+    ThreadPool::instance()->setThreads(numThreads);
+    ImageLoader::setExrThreads(ThreadPool::instance()->threads());
+    ImageCache::instance()->setCapacity(size_t(opt.imageCacheMb) * 1024
+                                        * 1024);
+    ImageDenoiser::instance()->configure(opt.denoiserThreads,
+                                         opt.denoiserAffinity, opt.useCuda,
+                                         opt.useOptiX);
+    int res = 0;
+    if(opt.shardTile > 0)
+    {
+        // Workers get the remaining options and a share of the cores
+        int workerThreads = std::max(int(std::thread::hardware_concurrency())
+                                     / opt.shardWorkers, 1);
+        std::string args;
+        for(int i = 2; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            if(arg == "-sh" || arg == "-sn" || arg == "-j" || arg == "-dt"
+                    || arg == "-P")
+            {
+                i++;
+                continue;
+            }
+            // Only the first pass recalculates; the second reads its caches
+            if(arg == "-c")
+                continue;
+            args += " \"" + arg + "\"";
+        }
+        args += " -j " + std::to_string(workerThreads) + " -dt "
+                + std::to_string(workerThreads) + " -P 1";
+        for(const std::string &path : paths)
+        {
+            if(paths.size() > 1)
+                std::cout << path << std::endl;
+
+            int r = shardFrame(path, opt, argv[0], args, std::cout);
+            if(r != 0)
+                res = r;
+        }
+    }
+    else if(paths.size() == 1)
+        res = processFrame(paths[0], opt, scheduler, std::cout);
+    else
+    {
+        // Batch: frames share the denoiser, which serializes its runs, so
+        // CPU stages of other frames fill the cores meanwhile
+        std::atomic<size_t> next(0);
+        std::mutex outMutex;
+        std::vector<std::thread> workers;
+        // Seeds (-tw) come from the frame before, so frames go in order
+        size_t count = std::min(paths.size(), opt.warmStart
+                                ? size_t(1) : size_t(framesInFlight));
+        for(size_t t = 0; t < count; t++)
+        {
+            workers.push_back(std::thread([&]() {
+                size_t k;
+                while((k = next++) < paths.size())
+                {
+                    std::ostringstream out;
+                    out << paths[k] << std::endl;
+                    int r = processFrame(paths[k], opt, scheduler, out,
+                                         k > 0 ? paths[k - 1]
+                                               : std::string());
+                    std::lock_guard<std::mutex> lock(outMutex);
+                    std::cout << out.str();
+                    if(r != 0)
+                        res = r;
+                }
+            }));
+        }
+        for(std::thread &worker : workers)
+            worker.join();
+    }
+    std::cout << "All done" << std::endl;
+    ImageCache::instance()->report(std::cout);
+    if(opt.memReport)
+        BufferPool::instance()->report(std::cout);
+
+    if(opt.timeBudget > 0)
+        scheduler.save(timingsPath);
+
+    ImageDenoiser::instance()->release();
+    return res;
+}
+
+namespace {
+// Previous level, kept for incremental recompute
+struct Level
+{
+    std::vector<float> img, var, estVar, denoised, sure, filteredSure;
+    std::vector<CurveParam> curves;
+    std::vector<int> weights;
+};
+
+// Steps 2-8 depend only on a level's own files and run as one task per
+// level; curves, weights and blending (9-12) are the serial chain that
+// consumes them in order
+struct LevelData
+{
+    bool ok = false;
+    std::ostringstream log;
+    bool useAlbedo = true;
+    bool useNormal = true;
+    // Level whose HDR and VAR are denoised (-u)
+    int denNo = 0;
+    bool incremental = false;
+    bool sparse = false;
+    // Stages run tile by tile; their caches carry tileTag
+    bool tiled = false;
+    std::string tileTag;
+    std::string sureExt;
+    std::vector<char> dirty, dirtyPx;
+    std::vector<float> img, var, estVar, estimate, denImg, denVar,
+                       denoised, sure, filteredSure;
+    std::string previewPath;
+    std::future<void> previewDone;
+};
+
+// DEN, SURE and filtered SURE of the -u level, for the levels above it
+struct SharedDen
+{
+    bool ok = false;
+    bool useAlbedo = true;
+    bool useNormal = true;
+    std::vector<float> denoised, sure, filteredSure;
+};
+
+// What the level tasks share: settings fixed for the frame, and state the
+// serial chain (or the -u level's task) updates between them
+struct FrameSetup
+{
+    FrameSetup(const Options &options, StageScheduler &stageScheduler)
+        : opt(options), scheduler(stageScheduler)
+    {
+    }
+
+    const Options &opt;
+    StageScheduler &scheduler;
+    std::string path, fileName;
+    std::vector<int> spp;
+    int denoiseUntil = -1;
+    // Levels above -u reuse DEN and SURE of the -u level
+    size_t denIdx = 0;
+    int w = 0, h = 0;
+    bool applyGB = false;
+    bool useOptiX = false;
+    ImageDenoiser::Backend denBackend = ImageDenoiser::OIDN;
+    ImageDenoiser::Backend estBackend = ImageDenoiser::OIDN;
+    ImageDenoiser::Quality denQuality = ImageDenoiser::High;
+    ImageDenoiser::Quality sureQuality = ImageDenoiser::High;
+    ImageDenoiser::Quality estQuality = ImageDenoiser::High;
+    int sureTries = 1;
+    std::string denName, estName, cacheExt, sureExt, denTag, sureTag, estTag;
+    // Curves alone (--outputs curves) need no DEN or SURE
+    bool needWeights = true;
+    // Whole-frame means of a -sh worker's frame (-fs), by spp
+    std::map<int, LevelStats> stats;
+    Level prev;
+    bool prevValid = false;
+    MomentState moments;
+    // HDR and VAR of the -u level from the moments, for the levels past it
+    std::vector<float> momentImg, momentVar;
+    // Weights of the last finished level, for the preview
+    std::vector<int> previewWeights;
+    std::vector<std::shared_future<void>> tasks;
+    // Levels above -u take DEN and SURE one at a time
+    std::mutex denMutex;
+    SharedDen den;
+};
+
+// Gaussian Blur
+const int winSize = 11;
+
+// NAME_NNNNNN of a level, which all its files start with
+std::string levelStem(const FrameSetup &frame, int levelSpp)
+{
+    std::string sppStr = std::to_string(levelSpp);
+    sppStr.insert(0, 6 - sppStr.length(), '0');
+    return frame.path + "/" + frame.fileName + "_" + sppStr;
+}
+
+// Start of the DEN, SURE and filtered SURE cache names of lv
+std::string denStem(const FrameSetup &frame, const LevelData &lv)
+{
+    return levelStem(frame, lv.denNo) + "spp." + frame.denName
+            + (lv.useNormal ? "_alb_nrm" : lv.useAlbedo ? "_alb" : "")
+            + frame.denTag;
+}
+
+// Full-frame results first, then tile-wise ones of an earlier run
+std::vector<float> loadLevelCache(const FrameSetup &frame,
+                                  const LevelData &lv,
+                                  const std::string &name, bool nonNegative)
+{
+    int w = frame.w, h = frame.h;
+    std::vector<float> data = loadCache(name, frame.opt.rawCache, w, h,
+                                        nonNegative);
+    if(data.empty() && !lv.tileTag.empty())
+        data = loadCache(tileCache(name, lv.tileTag), frame.opt.rawCache, w,
+                         h, nonNegative);
+    return data;
+}
+
+bool saveLevelCache(const FrameSetup &frame, const LevelData &lv,
+                    const std::vector<float> &data, const std::string &name)
+{
+    return saveCache(data, frame.w, frame.h,
+                     lv.tiled ? tileCache(name, lv.tileTag) : name,
+                     frame.opt.rawCache);
+}
+
+// Blur sigma from the mean of var, or of the whole frame in a shard
+std::vector<float> meanVar(const FrameSetup &frame, int levelSpp,
+                           const std::vector<float> &var)
+{
+    auto it = frame.stats.find(levelSpp);
+    return std::vector<float>(1, it != frame.stats.end()
+                              ? it->second.avgVar : ImageLoader::avg(var));
+}
+
+// 2-3. Read HDR and VAR of level i, or make them from its moments
+bool readLevel(FrameSetup &frame, size_t i, LevelData &lv)
+{
+    int w = frame.w, h = frame.h;
+    int levelSpp = frame.spp[i];
+    std::string stem = levelStem(frame, levelSpp);
+    if(frame.opt.moments)
+    {
+        MomentState &moments = frame.moments;
+        if(!readMoments(stem, levelSpp, frame.opt.momentDeltas, moments, w,
+                        h))
+        {
+            lv.log << "Error loading moments " << stem << "spp" << std::endl;
+            return false;
+        }
+        ImageLoader::fromMoments(moments.mean, moments.m2, moments.n, lv.img,
+                                 lv.var);
+        // Kept for the levels past -u, which denoise this one
+        if(levelSpp == frame.denoiseUntil)
+        {
+            frame.momentImg = lv.img;
+            frame.momentVar = lv.var;
+        }
+        return true;
+    }
+    // 2. Read VAR
+    std::string varPath = stem + "spp.var.exr";
+    lv.var = ImageLoader::loadImage(varPath, w, h, true);
+    if(lv.var.empty())
+    {
+        lv.log << "Error loading " << varPath << std::endl;
+        return false;
+    }
+    // 3. Read HDR
+    std::string imgPath = stem + "spp.hdr.exr";
+    lv.img = ImageLoader::loadImage(imgPath, w, h);
+    if(lv.img.empty())
+    {
+        lv.log << "Error loading " << imgPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// 3a-3b. Tiles to recompute: those changed since the previous level (-i)
+// or those with variance (-sp)
+void findTiles(const FrameSetup &frame, size_t i, LevelData &lv)
+{
+    const Options &opt = frame.opt;
+    int w = frame.w, h = frame.h;
+    // 3a. Find tiles that changed since the previous level
+    lv.incremental = opt.incremental && frame.prevValid && !frame.useOptiX
+            && frame.spp[i] == lv.denNo
+            && frame.prev.img.size() == lv.img.size();
+    if(lv.incremental)
+    {
+        ImageLoader::changedTiles(lv.img, frame.prev.img, w, h, incTile,
+                                  lv.dirty);
+        ImageLoader::changedTiles(lv.var, frame.prev.var, w, h, incTile,
+                                  lv.dirty);
+        lv.dirty = dilateTiles(lv.dirty, w, h);
+        size_t count = size_t(std::count(lv.dirty.begin(), lv.dirty.end(),
+                                         1));
+        // Beyond a quarter of the tiles the halos cost more than a frame
+        lv.incremental = 4 * count <= lv.dirty.size();
+        if(lv.incremental)
+            lv.dirtyPx = pixelMask(lv.dirty, w, h);
+
+        lv.log << "\t" << count << "/" << lv.dirty.size()
+               << " tiles changed" << std::endl;
+    }
+    // 3b. Tiles without variance pass the noisy value through
+    lv.sparse = !lv.incremental && opt.sparseThreshold >= 0
+            && !frame.useOptiX;
+    size_t activeCount = 0;
+    if(lv.sparse)
+    {
+        ImageLoader::activeTiles(lv.var, w, h, incTile, opt.sparseThreshold,
+                                 lv.dirty);
+        activeCount = size_t(std::count(lv.dirty.begin(), lv.dirty.end(),
+                                        1));
+        lv.sparse = activeCount < lv.dirty.size();
+        if(lv.sparse)
+            lv.dirtyPx = pixelMask(lv.dirty, w, h);
+
+        lv.log << "\t" << activeCount << "/" << lv.dirty.size()
+               << " tiles active" << std::endl;
+    }
+    // Crops pay for their halos, so few enough tiles are done one by
+    // one; otherwise only curves and weights skip the inactive ones
+    lv.tiled = lv.incremental
+            || (lv.sparse && 4 * activeCount <= lv.dirty.size());
+    // Sparse levels keep inactive tiles noisy, which depends on -sp T;
+    // tiles are denoised with full SURE whatever the -s fraction
+    lv.tileTag = lv.incremental ? ".inc" : "";
+    if(lv.tiled && !lv.incremental)
+    {
+        std::ostringstream tag;
+        tag << ".sparse" << opt.sparseThreshold;
+        lv.tileTag = tag.str();
+    }
+    lv.sureExt = lv.tiled ? ".sure" : frame.sureExt;
+}
+
+// 4. Filter VAR into the estimate the curves are fitted to
+void filterVar(FrameSetup &frame, size_t i, LevelData &lv)
+{
+    int w = frame.w, h = frame.h;
+    std::string stem = levelStem(frame, frame.spp[i]);
+    std::string estPath = frame.applyGB
+            ? stem + "spp.var.gb" + frame.cacheExt
+            : stem + "spp.var." + frame.estName + frame.estTag
+              + frame.cacheExt;
+    std::vector<float> est;
+    if(!frame.opt.recalcAll)
+        est = loadLevelCache(frame, lv, estPath, true);
+
+    // Sigma comes from the mean variance of the whole frame
+    std::vector<float> varMean = meanVar(frame, frame.spp[i], lv.var);
+    if(est.empty() && lv.tiled)
+    {
+        if(!frame.applyGB)
+            ImageDenoiser::instance()->init();
+        est = lv.incremental ? frame.prev.estVar : lv.var;
+        updateTiles(lv.dirty, w, h, est, [&](int x, int y, int cw, int ch,
+                    std::vector<float> &res) {
+            std::vector<float> crop = ImageLoader::crop(lv.var, w, h, x, y,
+                                                        cw, ch);
+            if(frame.applyGB)
+                ImageLoader::gaussianBlur(crop, res, cw, ch, winSize,
+                                          varMean);
+            else
+                ImageDenoiser::instance()->run(crop, cw, ch, res,
+                                               frame.estBackend, true, true,
+                                               frame.estQuality);
+        });
+        saveLevelCache(frame, lv, est, estPath);
+    }
+    else if(est.empty() && frame.applyGB)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        ImageLoader::gaussianBlur(lv.var, est, w, h, winSize, varMean);
+        frame.scheduler.record(StageScheduler::Blur, elapsedMs(t0), w, h);
+        saveLevelCache(frame, lv, est, estPath);
+    }
+    else if(est.empty())
+    {
+        ImageDenoiser::instance()->init();
+        auto t0 = std::chrono::steady_clock::now();
+        double waited = ImageDenoiser::instance()->waitedMs();
+        ImageDenoiser::instance()->run(lv.var, w, h, est, frame.estBackend,
+                                       true, true, frame.estQuality);
+        frame.scheduler.record(StageScheduler::denoiseStage(frame.estQuality),
+                               denoiseMs(t0, waited), w, h);
+        saveLevelCache(frame, lv, est, estPath);
+    }
+    if(frame.opt.incremental)
+        lv.estVar = est;
+
+    if(frame.opt.useLuminance)
+        est = ImageLoader::luminance(est, frame.opt.channelMax);
+
+    lv.estimate.swap(est);
+}
+
+// 5. If denoising stopped, read correct HDR and VAR for DEN/SURE
+bool readDenoiseInput(FrameSetup &frame, LevelData &lv)
+{
+    std::string stem = levelStem(frame, lv.denNo);
+    if(frame.opt.moments)
+    {
+        if(frame.momentImg.empty())
+        {
+            lv.log << "Moments for " << stem << "spp not read" << std::endl;
+            return false;
+        }
+        lv.denImg = frame.momentImg;
+        lv.denVar = frame.momentVar;
+        return true;
+    }
+    int w = frame.w, h = frame.h;
+    std::string imgPath = stem + "spp.hdr.exr";
+    lv.denImg = ImageLoader::loadImage(imgPath, w, h, false, true);
+    if(lv.denImg.empty())
+    {
+        lv.log << "Error loading " << imgPath << std::endl;
+        return false;
+    }
+    std::string varPath = stem + "spp.var.exr";
+    lv.denVar = ImageLoader::loadImage(varPath, w, h, true, true);
+    if(lv.denVar.empty())
+    {
+        lv.log << "Error loading " << varPath << std::endl;
+        return false;
     }
-    std::string path(argv[1]);
+    return true;
+}
+
+// 6a. Preview as soon as DEN is there, while SURE and curves run
+void startPreview(FrameSetup &frame, size_t i, LevelData &lv)
+{
+    if(!frame.opt.preview || frame.previewWeights.size() != lv.img.size())
+        return;
+
+    // Outlives the task: the chain waits for it in step 12b
+    FrameSetup *f = &frame;
+    LevelData *data = &lv;
+    int levelSpp = frame.spp[i];
+    lv.previewDone = std::async(std::launch::async, [f, data, levelSpp]() {
+        BufferPool *pool = BufferPool::instance();
+        std::vector<float> blend = pool->acquire(data->img.size(),
+                                                 "preview");
+        CurvePredictor::blend(data->img, data->denoised, levelSpp,
+                              f->previewWeights, blend);
+        publish(blend, f->w, f->h, data->previewPath);
+        pool->release(blend);
+    });
+}
+
+// 7. Denoise with albedo and normal when there are any, then SURE
+void denoiseLevel(FrameSetup &frame, size_t i, LevelData &lv,
+                  const std::string &denPath, const std::string &surePath)
+{
+    BufferPool *pool = BufferPool::instance();
+    int w = frame.w, h = frame.h;
+    const std::vector<float> &inputImg = lv.denImg.empty() ? lv.img
+                                                           : lv.denImg;
+    const std::vector<float> &inputVar = lv.denVar.empty() ? lv.var
+                                                           : lv.denVar;
+    std::string stem = levelStem(frame, lv.denNo);
+    std::vector<float> alb, nor;
+    if(lv.useAlbedo)
+    {
+        alb = ImageLoader::loadImage(stem + "spp.alb.exr", w, h);
+        lv.useAlbedo = !alb.empty();
+        if(lv.useAlbedo && lv.useNormal)
+        {
+            nor = ImageLoader::loadImage(stem + "spp.nrm.exr", w, h);
+            lv.useNormal = !nor.empty();
+        }
+    }
+    // Color, albedo and normal one after another
+    std::vector<float> guided;
+    if(lv.useAlbedo)
+    {
+        size_t planes = lv.useNormal ? 3 : 2;
+        guided = pool->acquire(planes * inputImg.size(), "guided");
+        std::copy(inputImg.begin(), inputImg.end(), guided.begin());
+        std::copy(alb.begin(), alb.end(),
+                  guided.begin() + long(inputImg.size()));
+        if(lv.useNormal)
+            std::copy(nor.begin(), nor.end(),
+                      guided.begin() + long(2 * inputImg.size()));
+    }
+    pool->release({&alb, &nor});
+    const std::vector<float> &denInput = lv.useAlbedo ? guided : inputImg;
+    ImageDenoiser::instance()->init();
+    if(lv.tiled)
+    {
+        lv.denoised = lv.incremental ? frame.prev.denoised : inputImg;
+        updateTiles(lv.dirty, w, h, lv.denoised, [&](int x, int y, int cw,
+                    int ch, std::vector<float> &res) {
+            ImageDenoiser::instance()->run(
+                        ImageLoader::crop(denInput, w, h, x, y, cw, ch),
+                        cw, ch, res, frame.denBackend, true, false,
+                        frame.denQuality);
+        });
+        saveLevelCache(frame, lv, lv.denoised, denPath);
+        startPreview(frame, i, lv);
+        if(lv.incremental)
+            lv.sure = frame.prev.sure;
+        else
+            lv.sure.assign(lv.denoised.size(), 0.0f);
+        updateTiles(lv.dirty, w, h, lv.sure, [&](int x, int y, int cw,
+                    int ch, std::vector<float> &res) {
+            res = CurvePredictor::sure(
+                        ImageLoader::crop(lv.denoised, w, h, x, y, cw, ch),
+                        ImageLoader::crop(denInput, w, h, x, y, cw, ch),
+                        cw, ch,
+                        ImageLoader::crop(inputVar, w, h, x, y, cw, ch),
+                        frame.denBackend, true, false, frame.sureTries,
+                        frame.sureQuality);
+        });
+        saveLevelCache(frame, lv, lv.sure, surePath);
+        pool->release(guided);
+        return;
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    double waited = ImageDenoiser::instance()->waitedMs();
+    ImageDenoiser::instance()->run(denInput, w, h, lv.denoised,
+                                   frame.denBackend, true, false,
+                                   frame.denQuality);
+    frame.scheduler.record(StageScheduler::denoiseStage(frame.denQuality),
+                           denoiseMs(t0, waited), w, h);
+    saveLevelCache(frame, lv, lv.denoised, denPath);
+    startPreview(frame, i, lv);
+
+    ImageDenoiser::instance()->init();
+    if(lv.sureExt == ".sure")
+    {
+        t0 = std::chrono::steady_clock::now();
+        waited = ImageDenoiser::instance()->waitedMs();
+        lv.sure = CurvePredictor::sure(lv.denoised, denInput, w, h, inputVar,
+                                       frame.denBackend, true, false,
+                                       frame.sureTries, frame.sureQuality);
+        frame.scheduler.record(
+                    StageScheduler::denoiseStage(frame.sureQuality),
+                    denoiseMs(t0, waited) / frame.sureTries, w, h);
+    }
+    else
+        lv.sure = CurvePredictor::sureTiled(lv.denoised, denInput, w, h,
+                                            inputVar, frame.opt.sureFraction,
+                                            frame.denBackend, true, false,
+                                            frame.sureQuality);
+    saveLevelCache(frame, lv, lv.sure, surePath);
+    // 7a. Report deviation of tiled SURE from full resolution
+    if(frame.opt.checkSure && lv.sureExt != ".sure")
+    {
+        std::vector<float> fullSure = CurvePredictor::sure(
+                    lv.denoised, denInput, w, h, inputVar, frame.denBackend,
+                    true, false);
+        std::vector<float> zero(fullSure.size(), 0.0f);
+        float rmse = std::sqrt(ImageLoader::mse(lv.sure, fullSure)
+                               / ImageLoader::mse(fullSure, zero));
+        lv.log << "\tSURE tiled " << ImageLoader::avg(lv.sure)
+               << " full " << ImageLoader::avg(fullSure)
+               << " rel. RMSE " << rmse << std::endl;
+        pool->release(fullSure);
+    }
+    pool->release(guided);
+}
+
+// 8. Filter SURE like VAR was in step 4
+void filterSure(FrameSetup &frame, LevelData &lv)
+{
+    int w = frame.w, h = frame.h;
+    std::string filteredPath = denStem(frame, lv) + lv.sureExt
+            + frame.sureTag
+            + (frame.applyGB ? ".gb" : "." + frame.estName + frame.estTag)
+            + frame.cacheExt;
+    if(!frame.opt.recalcAll)
+        lv.filteredSure = loadLevelCache(frame, lv, filteredPath, false);
+    if(!lv.filteredSure.empty())
+        return;
+
+    const std::vector<float> &inputVar = lv.denVar.empty() ? lv.var
+                                                           : lv.denVar;
+    std::vector<float> varMean = meanVar(frame, lv.denNo, inputVar);
+    if(!frame.applyGB)
+        ImageDenoiser::instance()->init();
+    if(lv.tiled)
+    {
+        if(lv.incremental)
+            lv.filteredSure = frame.prev.filteredSure;
+        else
+            lv.filteredSure.assign(lv.sure.size(), 0.0f);
+        updateTiles(lv.dirty, w, h, lv.filteredSure, [&](int x, int y,
+                    int cw, int ch, std::vector<float> &res) {
+            std::vector<float> crop = ImageLoader::crop(lv.sure, w, h, x, y,
+                                                        cw, ch);
+            if(frame.applyGB)
+                ImageLoader::gaussianBlur(crop, res, cw, ch, winSize,
+                                          varMean);
+            else
+                ImageDenoiser::instance()->run(crop, cw, ch, res,
+                                               frame.estBackend, true, true,
+                                               frame.estQuality);
+        });
+    }
+    else if(frame.applyGB)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        ImageLoader::gaussianBlur(lv.sure, lv.filteredSure, w, h, winSize,
+                                  varMean);
+        frame.scheduler.record(StageScheduler::Blur, elapsedMs(t0), w, h);
+    }
+    else
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        double waited = ImageDenoiser::instance()->waitedMs();
+        ImageDenoiser::instance()->run(lv.sure, w, h, lv.filteredSure,
+                                       frame.estBackend, true, true,
+                                       frame.estQuality);
+        frame.scheduler.record(StageScheduler::denoiseStage(frame.estQuality),
+                               denoiseMs(t0, waited), w, h);
+    }
+    saveLevelCache(frame, lv, lv.filteredSure, filteredPath);
+}
+
+// 6. Read DEN and SURE, or make them (7)
+void readDenoised(FrameSetup &frame, size_t i, LevelData &lv)
+{
+    std::string denPath = denStem(frame, lv) + frame.cacheExt;
+    std::string surePath = denStem(frame, lv) + lv.sureExt + frame.sureTag
+            + frame.cacheExt;
+    if(!frame.opt.recalcAll)
+    {
+        lv.denoised = loadLevelCache(frame, lv, denPath, false);
+        lv.sure = loadLevelCache(frame, lv, surePath, false);
+    }
+    if(!lv.denoised.empty() && !lv.sure.empty())
+        startPreview(frame, i, lv);
+    // 7. If DEN/SURE not read correctly, calculate
+    else
+        denoiseLevel(frame, i, lv, denPath, surePath);
+}
+
+// Steps 2-8 of level i; results and log go to lv
+void prepareLevel(FrameSetup &frame, size_t i, LevelData &lv)
+{
+    lv.denNo = std::min(frame.spp[i], frame.denoiseUntil);
+    if(!readLevel(frame, i, lv))
+        return;
+
+    findTiles(frame, i, lv);
+    filterVar(frame, i, lv);
+    if(!frame.needWeights && !frame.opt.statsPass)
+    {
+        lv.ok = true;
+        return;
+    }
+    // Levels above -u take DEN and SURE of the -u level from its task;
+    // without it (resumed past it, or it failed) the first of them makes
+    // them, whole-frame
+    std::unique_lock<std::mutex> lock(frame.denMutex, std::defer_lock);
+    SharedDen &den = frame.den;
+    if(frame.spp[i] != lv.denNo)
+    {
+        if(frame.denIdx < frame.spp.size()
+                && frame.tasks[frame.denIdx].valid())
+            frame.tasks[frame.denIdx].wait();
+        lock.lock();
+        if(den.ok)
+        {
+            lv.useAlbedo = den.useAlbedo;
+            lv.useNormal = den.useNormal;
+            lv.denoised = den.denoised;
+            lv.sure = den.sure;
+            lv.filteredSure = den.filteredSure;
+        }
+        else
+        {
+            lv.tiled = false;
+            lv.sureExt = frame.sureExt;
+            if(!readDenoiseInput(frame, lv))
+                return;
+        }
+    }
+    lv.previewPath = levelStem(frame, frame.spp[i]) + "spp.preview."
+            + frame.denName
+            + (lv.useNormal ? "_alb_nrm" : lv.useAlbedo ? "_alb" : "")
+            + ".exr";
+    if(!lv.filteredSure.empty())
+    {
+        startPreview(frame, i, lv);
+        lv.ok = true;
+        return;
+    }
+    readDenoised(frame, i, lv);
+    filterSure(frame, lv);
+    // Kept for the levels above -u
+    if(lv.denNo == frame.denoiseUntil && i + 1 < frame.spp.size())
+    {
+        den.useAlbedo = lv.useAlbedo;
+        den.useNormal = lv.useNormal;
+        den.denoised = lv.denoised;
+        den.sure = lv.sure;
+        den.filteredSure = lv.filteredSure;
+        den.ok = true;
+    }
+    lv.ok = true;
+}
+
+int processFrame(const std::string &path, const Options &opt,
+                 StageScheduler &scheduler, std::ostream &out,
+                 const std::string &prevPath)
+{
+    // Per-frame copies: albedo/normal are dropped if missing in this frame
+    bool useAlbedo = opt.useAlbedo;
+    bool useNormal = opt.useNormal;
+    bool applyGB = opt.applyGB;
+    bool useOptiX = opt.useOptiX;
+    ImageDenoiser::Backend denBackend = useOptiX ? ImageDenoiser::OptiX
+                                      : opt.useATrous ? ImageDenoiser::ATrous
+                                                      : ImageDenoiser::OIDN;
+    ImageDenoiser::Backend estBackend = opt.estATrous ? ImageDenoiser::ATrous
+                                                      : denBackend;
+    std::string denName = useOptiX ? "optix"
+                                   : opt.useATrous ? "atrous" : "oidn";
+    int denoiseUntil = opt.denoiseUntil;
+    bool recalcAll = opt.recalcAll;
+    float budgetTarget = opt.budgetTarget;
+    float stopTarget = opt.stopTarget;
+    float sureFraction = opt.sureFraction;
+    bool useLuminance = opt.useLuminance;
+    bool rawCache = opt.rawCache;
+    int curveBlock = opt.curveBlock;
+    bool channelMax = opt.channelMax;
+    float timeBudget = opt.timeBudget;
+    ImageDenoiser::Quality denQuality = ImageDenoiser::High;
+    ImageDenoiser::Quality sureQuality = ImageDenoiser::High;
+    ImageDenoiser::Quality estQuality = ImageDenoiser::High;
+    int sureTries = 1;
+    BufferPool *pool = BufferPool::instance();
     std::vector<std::experimental::filesystem::path> files;
     for(const auto &entry : std::experimental::filesystem::directory_iterator(path))
     {
@@ -78,7 +1504,7 @@ help:
     }
     if(files.empty())
     {
-        std::cout << "No HDR found!" << std::endl;
+        out << "No HDR found!" << std::endl;
         return -1;
     }
     std::string fileName = files.back().filename().string();
@@ -94,268 +1520,467 @@ help:
         std::string n = baseName.substr(baseName.length() - 17);
         spp.push_back(std::stoi(n));
     }
+    if(opt.moments)
+    {
+        // Levels come from the moment buffers; HDR is only the reference
+        spp.clear();
+        for(const auto &entry : std::experimental::filesystem::directory_iterator(path))
+        {
+            std::string baseName = entry.path().filename().string();
+            if(baseName.length() < c + 7 || baseName.substr(0, c) != fileName
+                    || baseName[c] != '_')
+                continue;
+
+            std::string ext = baseName.substr(c + 7);
+            if(ext == "spp.sum.exr" || ext == "spp.mean.exr")
+                spp.push_back(std::stoi(baseName.substr(c + 1, 6)));
+        }
+        std::sort(spp.begin(), spp.end());
+        spp.erase(std::unique(spp.begin(), spp.end()), spp.end());
+        if(spp.empty())
+        {
+            out << "No moment buffers found!" << std::endl;
+            return -1;
+        }
+    }
     if(denoiseUntil == -1 || std::find(spp.begin(), spp.end(), denoiseUntil) == spp.end())
         denoiseUntil = spp.back();
 
     int w = 0, h = 0;
-    // 1. Read REF
+    // 1. Read REF, only for errors and diffs; its header gives the size
     std::string refPath = files.back().string();
-    std::vector<float> ref = ImageLoader::loadImage(refPath, w, h);
-
-    std::string denAlg = useOptiX ? "OptiX" : "OIDN";
-    std::cout << "\tOURS\t\t" << denAlg << "\t\tMC" << std::endl;
+    std::vector<float> ref;
+    if(opt.outputs & (OutMse | OutDiff))
+        ref = ImageLoader::loadImage(refPath, w, h);
+    else if(!ImageLoader::imageSize(refPath, w, h))
+    {
+        out << "Error loading " << refPath << std::endl;
+        return -1;
+    }
 
-    size_t len = spp.size();
-    std::vector<std::vector<float>> varsVec;
-    for(size_t i = 0; i < len; i++)
+    if(timeBudget > 0)
     {
-        int denNo = std::min(spp[i], denoiseUntil);
-        std::string sppStr = std::to_string(spp[i]);
-        sppStr.insert(0, 6 - sppStr.length(), '0');
-        std::string denNoStr = std::to_string(denNo);
-        denNoStr.insert(0, 6 - denNoStr.length(), '0');
+        StageScheduler::Plan plan = scheduler.plan(w, h);
+        denQuality = plan.denoiseQuality;
+        sureQuality = plan.sureQuality;
+        estQuality = plan.estimateQuality;
+        sureTries = plan.sureTries;
+        applyGB = plan.applyGB;
+        std::string den = denQuality == ImageDenoiser::High ? "high"
+                                                            : "balanced";
+        std::string probe = sureQuality == ImageDenoiser::High ? "high"
+                                                               : "balanced";
+        std::string est = applyGB ? "Gaussian blur"
+                                  : estQuality == ImageDenoiser::High
+                                    ? "high OIDN" : "balanced OIDN";
+        out << "Plan: " << den << " denoise, " << sureTries << "x "
+            << probe << " SURE, " << est << " estimates" << std::endl;
+    }
 
-        // 2. Read VAR
-        std::string varPath = path + "/" + fileName + "_" + sppStr
-                + "spp.var.exr";
-        std::vector<float> var = ImageLoader::loadImage(varPath, w, h);
-        if(var.empty())
-        {
-            std::cout << "Error loading " << varPath << std::endl;
-            continue;
-        }
-        // 3. Read HDR
-        std::string imgPath = path + "/" + fileName + "_" + sppStr
-                + "spp.hdr.exr";
-        std::vector<float> img = ImageLoader::loadImage(imgPath, w, h);
-        if(img.empty())
-        {
-            std::cout << "Error loading " << imgPath << std::endl;
-            continue;
-        }
-        // 4. Filter VAR
-        if(applyGB)
-        {
-            std::string varGaussPath = path + "/" + fileName + "_" + sppStr
-                    + "spp.var.gb.exr";
-            std::vector<float> gaussVar;
-            if(!recalcAll)
-                gaussVar = ImageLoader::loadImage(varGaussPath, w, h);
+    std::string sureExt = sureFraction > 0 && sureFraction < 1
+            ? ".sure.tiled" : ".sure";
+    std::string cacheExt = rawCache ? ".raw" : ".exr";
+    std::string estName = estBackend == ImageDenoiser::ATrous ? "atrous"
+                                                              : "oidn";
+    std::string estExt = applyGB ? ".gb" : "." + estName;
+    // Results of cheaper plans (-T) are cached apart from full quality
+    std::string denTag = qualityTag(denQuality);
+    std::string sureTag = qualityTag(sureQuality)
+            + (sureTries > 1 ? ".x" + std::to_string(sureTries) : "");
+    std::string estTag = qualityTag(estQuality);
+    std::string denAlg = useOptiX ? "OptiX"
+                                  : opt.useATrous ? "A-trous" : "OIDN";
+    if(opt.outputs & OutMse)
+        out << "\tOURS\t\t" << denAlg << "\t\tMC" << std::endl;
 
-            if(gaussVar.empty())
-            {
-                ImageLoader::gaussianBlur(var, gaussVar, w, h, winSize, var);
-                ImageLoader::saveExr(gaussVar, w, h, varGaussPath);
-            }
-            varsVec.push_back(gaussVar);
-        }
-        else
+    // Products not asked for are never computed
+    bool needBlend = (opt.outputs & (OutBlended | OutMse | OutDiff))
+            || opt.preview;
+    bool needWeights = needBlend || (opt.outputs & OutWeights)
+            || budgetTarget > 0 || stopTarget > 0 || opt.incremental;
+    bool needCurves = needWeights || (opt.outputs & OutCurves);
+    // Pixels the fit cannot reach yet start from the previous frame
+    std::vector<CurveParam> seed;
+    if(opt.warmStart && !prevPath.empty() && needCurves)
+    {
+        seed = loadSeed(prevPath, path, fileName, w, h, out);
+        // One curve per pixel in luminance mode
+        if(useLuminance)
         {
-            std::string varOidnPath = path + "/" + fileName + "_" + sppStr
-                    + "spp.var.oidn.exr";
-            std::vector<float> oidnVar;
-            if(!recalcAll)
-                oidnVar = ImageLoader::loadImage(varOidnPath, w, h);
-
-            if(oidnVar.empty())
-            {
-                ImageDenoiser::instance()->init();
-                ImageDenoiser::instance()->run(var, w, h, oidnVar, useOptiX,
-                                               true, true);
-                ImageLoader::saveExr(oidnVar, w, h, varOidnPath);
-            }
-            varsVec.push_back(oidnVar);
+            for(size_t p = 0; p < seed.size() / 3; p++)
+                seed[p] = seed[3 * p];
+            seed.resize(seed.size() / 3);
         }
-        std::vector<float> inputImg = img;
-        std::vector<float> inputVar = var;
+        if(!seed.empty())
+            out << "Curves seeded from " << prevPath << std::endl;
+    }
 
-        // 5. If denoising stopped, read correct HDR and VAR for DEN/SURE
-        if(spp[i] != denNo)
+    size_t len = spp.size();
+    std::vector<std::vector<float>> varsVec;
+    // spp of each estimate in varsVec, which starts late after a resume
+    std::vector<int> varsSpp;
+    size_t first = 0;
+    // Curve fit state (-ck) depends on how the estimates were made
+    std::string ckptPath = path + "/" + fileName + ".curves" + estExt
+            + (applyGB ? "" : estTag)
+            + (useLuminance ? channelMax ? ".max" : ".lum" : "") + ".ckpt";
+    if(opt.checkpoint && !recalcAll && !opt.moments && !opt.statsPass)
+    {
+        int cw = 0, ch = 0;
+        std::vector<int> ckptSpp;
+        if(ImageLoader::loadCheckpoint(ckptPath, cw, ch, ckptSpp, varsVec))
         {
-            std::string imgPath = path + "/" + fileName + "_" + denNoStr
-                    + "spp.hdr.exr";
-            inputImg = ImageLoader::loadImage(imgPath, w, h);
-            if(inputImg.empty())
+            auto last = ckptSpp.empty() ? spp.end()
+                                        : std::find(spp.begin(), spp.end(),
+                                                    ckptSpp.back());
+            if(cw == w && ch == h && last != spp.end())
             {
-                std::cout << "Error loading " << imgPath << std::endl;
-                continue;
+                first = size_t(last - spp.begin()) + 1;
+                varsSpp.swap(ckptSpp);
+                out << "Resumed after " << varsSpp.back() << "spp, "
+                    << len - first << " new levels" << std::endl;
             }
-            std::string varPath = path + "/" + fileName + "_" + denNoStr
-                    + "spp.var.exr";
-            inputVar = ImageLoader::loadImage(varPath, w, h);
-            if(inputVar.empty())
+            else
             {
-                std::cout << "Error loading " << varPath << std::endl;
-                continue;
+                for(std::vector<float> &vars : varsVec)
+                    pool->release(vars);
+                varsVec.clear();
             }
         }
-        // 6. Read DEN
-        std::string denPath = path + "/" + fileName + "_" + denNoStr
-                + "spp." + (useOptiX ? "optix" : "oidn")
-                + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                + ".exr";
-        std::vector<float> denoised;
-        if(!recalcAll)
-            denoised = ImageLoader::loadImage(denPath, w, h);
-
-        // ...and SURE
-        std::string surePath = path + "/" + fileName + "_" + denNoStr
-                + "spp." + (useOptiX ? "optix" : "oidn")
-                + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                + ".sure.exr";
-        std::vector<float> sure;
-        if(!recalcAll)
-            sure = ImageLoader::loadImage(surePath, w, h);
-
-        // 7. If DEN/SURE not read correctly, calculate
-        if(denoised.empty() || sure.empty())
+    }
+    FrameSetup frame(opt, scheduler);
+    frame.path = path;
+    frame.fileName = fileName;
+    frame.spp = spp;
+    frame.denoiseUntil = denoiseUntil;
+    frame.denIdx = size_t(std::find(spp.begin(), spp.end(), denoiseUntil)
+                          - spp.begin());
+    frame.w = w;
+    frame.h = h;
+    frame.applyGB = applyGB;
+    frame.useOptiX = useOptiX;
+    frame.denBackend = denBackend;
+    frame.estBackend = estBackend;
+    frame.denQuality = denQuality;
+    frame.sureQuality = sureQuality;
+    frame.estQuality = estQuality;
+    frame.sureTries = sureTries;
+    frame.denName = denName;
+    frame.estName = estName;
+    frame.cacheExt = cacheExt;
+    frame.sureExt = sureExt;
+    frame.denTag = denTag;
+    frame.sureTag = sureTag;
+    frame.estTag = estTag;
+    frame.needWeights = needWeights;
+    frame.tasks.resize(len);
+    if(!opt.frameStats.empty()
+            && !loadFrameStats(opt.frameStats, frame.stats))
+    {
+        out << "Error loading " << opt.frameStats << std::endl;
+        return -1;
+    }
+    // State carried from level to level (-i, -w, -pv) keeps them in order
+    size_t ahead = opt.incremental || opt.moments || opt.preview
+            ? 1 : size_t(std::max(opt.levelsInFlight, 1));
+    std::vector<std::unique_ptr<LevelData>> levels(len);
+    size_t launched = first;
+    for(size_t i = first; i < len; i++)
+    {
+        for(; launched < len && launched < i + ahead; launched++)
         {
-            std::vector<float> alb, nor;
-            if(useAlbedo)
-            {
-                std::string albPath = path + "/" + fileName + "_"
-                        + denNoStr + "spp.alb.exr";
-                alb = ImageLoader::loadImage(albPath, w, h);
-                useAlbedo = !alb.empty();
-                if(useAlbedo && useNormal)
-                {
-                    std::string norPath = path + "/" + fileName + "_"
-                            + denNoStr + "spp.nrm.exr";
-                    nor = ImageLoader::loadImage(norPath, w, h);
-                    useNormal = !nor.empty();
-                }
-            }
-            if(useAlbedo)
-            {
-                inputImg.resize(6 * size_t(w * h));
-                size_t len = 3 * size_t(w * h) * sizeof(float);
-                memcpy(inputImg.data() + 3 * w * h, alb.data(), len);
-                if(useNormal)
-                {
-                    inputImg.resize(9 * size_t(w * h));
-                    memcpy(inputImg.data() + 6 * w * h, nor.data(), len);
-                }
-            }
-            ImageDenoiser::instance()->init();
-            ImageDenoiser::instance()->run(inputImg, w, h, denoised, useOptiX,
-                                           true, false);
-            ImageLoader::saveExr(denoised, w, h, denPath);
+            levels[launched].reset(new LevelData());
+            levels[launched]->useAlbedo = useAlbedo;
+            levels[launched]->useNormal = useNormal;
+            if(ahead == 1)
+                prepareLevel(frame, launched, *levels[launched]);
+            else
+                frame.tasks[launched] = std::async(
+                            std::launch::async, prepareLevel,
+                            std::ref(frame), launched,
+                            std::ref(*levels[launched])).share();
+        }
+        if(frame.tasks[i].valid())
+            frame.tasks[i].wait();
 
-            ImageDenoiser::instance()->init();
-            sure = CurvePredictor::sure(denoised, inputImg, w, h, inputVar,
-                                        useOptiX, true, false);
-            ImageLoader::saveExr(sure, w, h, surePath);
+        std::unique_ptr<LevelData> lv(std::move(levels[i]));
+        out << lv->log.str();
+        if(!lv->ok)
+        {
+            pool->release({&lv->img, &lv->var, &lv->estVar, &lv->estimate,
+                           &lv->denImg, &lv->denVar, &lv->denoised,
+                           &lv->sure, &lv->filteredSure});
+            continue;
         }
-        // 8. Filter SURE
-        std::vector<float> filteredSure;
-        if(applyGB)
+        int denNo = std::min(spp[i], denoiseUntil);
+        std::string sppStr = std::to_string(spp[i]);
+        sppStr.insert(0, 6 - sppStr.length(), '0');
+        // First pass of a -sh worker: SURE for the frame-wide mean only
+        if(opt.statsPass)
         {
-            std::string filteredPath = path + "/" + fileName + "_"
-                    + denNoStr + "spp." + (useOptiX ? "optix" : "oidn")
-                    + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                    + ".sure.gb.exr";
-            if(!recalcAll)
-                filteredSure = ImageLoader::loadImage(filteredPath, w, h);
-
-            if(filteredSure.empty())
-            {
-                ImageLoader::gaussianBlur(sure, filteredSure, w, h, winSize,
-                                          inputVar);
-                ImageLoader::saveExr(filteredSure, w, h, filteredPath);
-            }
+            ImageLoader::saveExr(lv->sure, w, h, path + "/" + fileName + "_"
+                                 + sppStr + "spp.sure.exr",
+                                 ImageLoader::ExrFormat{ImageLoader::Zip,
+                                                        false});
+            pool->release({&lv->img, &lv->var, &lv->estVar, &lv->estimate,
+                           &lv->denImg, &lv->denVar, &lv->denoised,
+                           &lv->sure, &lv->filteredSure});
+            continue;
         }
-        else
+        useAlbedo = lv->useAlbedo;
+        useNormal = lv->useNormal;
+        bool incremental = lv->incremental;
+        bool sparse = lv->sparse;
+        const std::vector<char> &dirtyPx = lv->dirtyPx;
+        std::vector<float> &img = lv->img, &var = lv->var,
+                &estVar = lv->estVar, &denImg = lv->denImg,
+                &denVar = lv->denVar, &denoised = lv->denoised,
+                &sure = lv->sure, &filteredSure = lv->filteredSure;
+        const std::string &previewPath = lv->previewPath;
+        std::future<void> &previewDone = lv->previewDone;
+        Level &prev = frame.prev;
+        varsVec.push_back(std::move(lv->estimate));
+        varsSpp.push_back(spp[i]);
+        // Shards (-fs) decide 9 and 11a as the whole frame would
+        auto stats = frame.stats.find(spp[i]);
+        bool frameWide = stats != frame.stats.end();
+        float avgSure = 0, avgVar = 0;
+        if(needWeights)
         {
-            std::string filteredPath = path + "/" + fileName + "_"
-                    + denNoStr + "spp." + (useOptiX ? "optix" : "oidn")
-                    + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                    + ".sure.oidn.exr";
-            if(!recalcAll)
-                filteredSure = ImageLoader::loadImage(filteredPath, w, h);
-
-            if(filteredSure.empty())
-            {
-                ImageDenoiser::instance()->init();
-                ImageDenoiser::instance()->run(sure, w, h, filteredSure,
-                                               useOptiX, true, true);
-                ImageLoader::saveExr(filteredSure, w, h, filteredPath);
-            }
+            avgSure = frameWide ? stats->second.avgSure
+                                : ImageLoader::avg(sure);
+            avgVar = frameWide ? stats->second.avgVar
+                               : ImageLoader::avg(var);
         }
-        float avgSure = ImageLoader::avg(sure);
-        float avgVar = ImageLoader::avg(var);
 
-        std::vector<float> filteredVar = varsVec.back();
         // 9. If OIDN for estimates, stop filtering if avgSure > avgVar
-        if(!applyGB && avgSure > avgVar)
+        bool unfiltered = needWeights && !applyGB && avgSure > avgVar;
+        std::vector<float> lumVar;
+        if(unfiltered)
         {
-            filteredSure = sure;
-            filteredVar = var;
+            pool->release(filteredSure);
+            filteredSure.swap(sure);
+            if(useLuminance)
+                lumVar = ImageLoader::luminance(var, channelMax);
         }
+        const std::vector<float> &filteredVar = !unfiltered ? varsVec.back()
+                                                : useLuminance ? lumVar : var;
         // 10. Calculate curves on-the-fly
         std::string slopePath = path + "/" + fileName + "_" + sppStr
                 + "spp.slope.exr";
         std::string interceptPath = path + "/" + fileName + "_" + sppStr
                 + "spp.intercept.exr";
-        std::vector<CurveParam> curveParams = CurvePredictor::calcCurves(
-                    varsVec, spp.data());
-        ImageLoader::saveExr(curveParams, w, h, slopePath, interceptPath); // For debug
+        std::vector<CurveParam> curveParams;
+        if(needCurves && curveBlock > 1)
+        {
+            // Fit on block means, then smooth back to full resolution
+            std::vector<CurveParam> blockParams =
+                    CurvePredictor::calcBlockCurves(varsVec, varsSpp.data(),
+                                                    w, h, curveBlock);
+            curveParams = CurvePredictor::interpolateCurves(blockParams, w, h,
+                                                            curveBlock);
+            if(opt.outputs & OutCurves)
+                ImageLoader::saveExr(blockParams,
+                                     (w + curveBlock - 1) / curveBlock,
+                                     (h + curveBlock - 1) / curveBlock,
+                                     slopePath, interceptPath); // For debug
+        }
+        else if(needCurves)
+        {
+            curveParams = CurvePredictor::calcCurves(
+                        varsVec, varsSpp.data(), true,
+                        incremental || sparse ? &dirtyPx : nullptr,
+                        incremental ? &prev.curves : nullptr,
+                        seed.empty() ? nullptr : &seed);
+            if(opt.outputs & OutCurves)
+                ImageLoader::saveExr(curveParams, w, h, slopePath, interceptPath); // For debug
+        }
 
         // 11. Calculate weights
         std::string weightsPath = path + "/" + fileName + "_" + sppStr
                 + "spp.weights.exr";
-        std::vector<int> weights(var.size(), 0);
-        for(size_t j = 0; j < weights.size(); j++)
+        // In luminance mode one weight is shared by all channels
+        size_t stride = useLuminance ? 3 : 1;
+        std::vector<float> lumSure, lumImg;
+        std::vector<int> weights;
+        if(needWeights)
         {
-            float s = filteredSure[j];
-            float v = filteredVar[j];
+            if(useLuminance)
+            {
+                lumSure = ImageLoader::luminance(filteredSure, channelMax);
+                lumImg = ImageLoader::luminance(img, channelMax);
+            }
+            const std::vector<float> &sureIn = useLuminance ? lumSure
+                                                            : filteredSure;
+            const std::vector<float> &imgIn = useLuminance ? lumImg : img;
+            weights.assign(var.size(), 0);
+            ThreadPool::instance()->parallelFor(
+                        sureIn.size(), [&](size_t begin, size_t end) {
+                for(size_t j = begin; j < end; j++)
+                {
+                    // Clean tiles keep the previous level's weight, inactive
+                    // ones take the noisy value
+                    if((incremental || sparse) && !dirtyPx[j * stride / 3])
+                    {
+                        for(size_t k = j * stride; k < (j + 1) * stride; k++)
+                            weights[k] = incremental ? prev.weights[k] : 0;
+                        continue;
+                    }
+                    float s = sureIn[j];
+                    float v = filteredVar[j];
 
-            if(!std::isnormal(s)) s = 0;
-            if(!std::isnormal(v)) v = 0;
+                    // 11a. If avgVar > avgSure set negative SURE to 0;
+                    // otherwise, to magnitude
+                    if(avgVar > avgSure)
+                        s = std::max(s, 0.0f);
+                    else
+                        s = std::abs(s);
 
-            // 11a. If avgVar > avgSure set negative SURE to 0;
-            // otherwise, to magnitude
-            if(avgVar > avgSure)
-                s = std::max(s, 0.0f);
-            else
-                s = std::abs(s);
+                    // 11b. Min. weight for DEN
+                    int minWgh = CurvePredictor::calcMinWeight(v, s, imgIn[j],
+                                                               spp[i]);
+                    // 11c. Weight
+                    int weight = CurvePredictor::denoisedWeight(s,
+                                                                curveParams[j],
+                                                                minWgh);
+                    for(size_t k = 0; k < stride; k++)
+                        weights[j * stride + k] = weight;
+                }
+            });
+            if(opt.outputs & OutWeights)
+                ImageLoader::saveExr(weights, w, h, weightsPath); // For debug
+        }
+        // 11d. Additional samples per pixel to reach target relMSE
+        if(budgetTarget > 0)
+        {
+            std::string budgetPath = path + "/" + fileName + "_" + sppStr
+                    + "spp.budget.exr";
+            std::vector<float> budget = pool->acquire(weights.size(),
+                                                      "budget");
+            ThreadPool::instance()->parallelFor(
+                        budget.size() / 3, [&](size_t begin, size_t end) {
+                for(size_t j = 3 * begin; j < 3 * end; j += 3)
+                {
+                    int maxBudget = 0;
+                    for(size_t k = j; k < j + 3; k++)
+                    {
+                        size_t p = k / stride;
+                        float d = denoised[k];
+                        float v = filteredVar[p];
 
-            // 11b. Min. weight for DEN
-            int minWgh = CurvePredictor::calcMinWeight(v, s, img[j], spp[i]);
-            // 11c. Weight
-            weights[j] = CurvePredictor::denoisedWeight(s, curveParams[j],
-                                                        minWgh);
+                        float target = budgetTarget * (d * d + 0.01f);
+                        int b = CurvePredictor::sampleBudget(
+                                    target, v, curveParams[p], spp[i],
+                                    weights[k]);
+                        maxBudget = std::max(maxBudget, b);
+                    }
+                    budget[j] = budget[j + 1] = budget[j + 2]
+                            = float(maxBudget);
+                }
+            });
+            // Plain sample counts, exact in 32-bit float
+            ImageLoader::saveExr(budget, w, h, budgetPath,
+                                 ImageLoader::ExrFormat{ImageLoader::Zip,
+                                                        false});
+            pool->release(budget);
         }
-        ImageLoader::saveExr(weights, w, h, weightsPath); // For debug
         // 12. Blending
         std::vector<float> blended;
-        CurvePredictor::blend(img, denoised, spp[i], weights, blended);
-        float b = ImageLoader::mse(blended, ref);
-        float d = ImageLoader::mse(denoised, ref);
-        float n = ImageLoader::mse(img, ref);
-        std::cout << sppStr << "\t" << b << "\t" << d << "\t" << n
-                  << std::endl;
+        if(needBlend)
+        {
+            blended = pool->acquire(img.size(), "blend");
+            CurvePredictor::blend(img, denoised, spp[i], weights, blended);
+        }
+        if(opt.outputs & OutMse)
+        {
+            float b = ImageLoader::mse(blended, ref);
+            float d = ImageLoader::mse(denoised, ref);
+            float n = ImageLoader::mse(img, ref);
+            out << sppStr << "\t" << b << "\t" << d << "\t" << n
+                << std::endl;
+        }
+        else
+            out << sppStr << std::endl;
+        // 12a. Predict when the blend reaches the target error
+        if(stopTarget > 0)
+        {
+            int stopAt = CurvePredictor::stopSpp(stopTarget, filteredVar,
+                                                 denoised, curveParams,
+                                                 weights, spp[i]);
+            if(stopAt > 0)
+                out << "\tstop at " << stopAt << " spp" << std::endl;
+            else
+                out << "\tstop not reached below 65536 spp"
+                    << std::endl;
+        }
 
         std::string bndPath = path + "/" + fileName + "_" + sppStr
-                + "spp.ours." + (useOptiX ? "optix" : "oidn")
+                + "spp.ours." + denName
                 + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                + (applyGB ? ".gb" : ".oidn") + ".exr";
-        ImageLoader::saveExr(blended, w, h, bndPath);
+                + estExt + ".exr";
+        if(opt.outputs & OutBlended)
+            ImageLoader::saveExr(blended, w, h, bndPath,
+                                 ImageLoader::Delivered);
+        // 12b. The exact blend replaces the preview
+        if(opt.preview)
+        {
+            if(previewDone.valid())
+                previewDone.wait();
+            publish(blended, w, h, previewPath);
+            frame.previewWeights = weights;
+        }
 
-        std::string diffPath = path + "/" + fileName + "_" + sppStr
-                + "spp.ours." + (useOptiX ? "optix" : "oidn")
-                + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                + (applyGB ? ".gb" : ".oidn") + ".diff.exr";
-        std::vector<float> diff = ImageLoader::diff(blended, ref);
-        ImageLoader::saveExr(diff, w, h, diffPath);
+        std::vector<float> diff;
+        if(opt.outputs & OutDiff)
+        {
+            std::string diffPath = path + "/" + fileName + "_" + sppStr
+                    + "spp.ours." + denName
+                    + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
+                    + estExt + ".diff.exr";
+            diff = ImageLoader::diff(blended, ref);
+            ImageLoader::saveExr(diff, w, h, diffPath, ImageLoader::Debug);
 
-        diffPath = path + "/" + fileName + "_" + sppStr + "spp."
-                + (useOptiX ? "optix" : "oidn")
-                + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
-                + ".diff.exr";
-        diff = ImageLoader::diff(denoised, ref);
-        ImageLoader::saveExr(diff, w, h, diffPath);
+            diffPath = path + "/" + fileName + "_" + sppStr + "spp."
+                    + denName
+                    + (useNormal ? "_alb_nrm" : useAlbedo ? "_alb" : "")
+                    + ".diff.exr";
+            pool->release(diff);
+            diff = ImageLoader::diff(denoised, ref);
+            ImageLoader::saveExr(diff, w, h, diffPath, ImageLoader::Debug);
+        }
+        // Keep this level's results for the next incremental pass; after
+        // step 9 filteredSure holds unfiltered SURE, so start over
+        if(opt.incremental)
+        {
+            frame.prevValid = !unfiltered && spp[i] == denNo;
+            prev.img.swap(img);
+            prev.var.swap(var);
+            prev.estVar.swap(estVar);
+            prev.denoised.swap(denoised);
+            prev.sure.swap(sure);
+            prev.filteredSure.swap(filteredSure);
+            prev.curves.swap(curveParams);
+            prev.weights.swap(weights);
+        }
+        // Everything of this level is written: a later run resumes here
+        // with the estimates any pixel's fit still reaches; block curves
+        // fit block means and keep them all
+        if(opt.checkpoint)
+        {
+            size_t keep = curveBlock > 1
+                    ? varsVec.size()
+                    : varsVec.size() - CurvePredictor::fitStart(varsVec);
+            ImageLoader::saveCheckpoint(varsSpp, varsVec, keep, w, h,
+                                        ckptPath);
+        }
+        // Hand this level's frames to the next one
+        pool->release({&var, &img, &denImg, &denVar, &denoised, &sure,
+                       &filteredSure, &lumVar, &lumSure, &lumImg, &blended,
+                       &diff, &estVar});
     }
-    std::cout << "All done" << std::endl;
-    ImageDenoiser::instance()->release();
+    pool->release({&frame.moments.mean, &frame.moments.m2, &frame.momentImg,
+                   &frame.momentVar, &frame.den.denoised, &frame.den.sure,
+                   &frame.den.filteredSure});
     return 0;
 }
+}
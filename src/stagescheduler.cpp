@@ -0,0 +1,124 @@
+/**
+ * @file stagescheduler.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#include "stagescheduler.h"
+#include <fstream>
+#include <limits>
+
+namespace {
+const char *stageNames[StageScheduler::StageCount] = {
+    "denoise_high", "denoise_balanced", "blur"
+};
+
+// Plans from the best to the cheapest one
+const StageScheduler::Plan plans[] = {
+    {ImageDenoiser::High, ImageDenoiser::High, ImageDenoiser::High, 2, false},
+    {ImageDenoiser::High, ImageDenoiser::High, ImageDenoiser::Balanced, 1,
+     false},
+    {ImageDenoiser::High, ImageDenoiser::High, ImageDenoiser::High, 1, true},
+    {ImageDenoiser::High, ImageDenoiser::Balanced, ImageDenoiser::Balanced, 1,
+     true},
+    {ImageDenoiser::Balanced, ImageDenoiser::Balanced,
+     ImageDenoiser::Balanced, 1, true}
+};
+const size_t planCount = sizeof(plans) / sizeof(plans[0]);
+}
+
+StageScheduler::StageScheduler(float budgetMs)
+    : m_budget(budgetMs)
+{
+    for(int i = 0; i < StageCount; i++)
+        m_msPerMPixel[i] = 0;
+}
+
+bool StageScheduler::load(const std::string &fileName)
+{
+    std::ifstream file(fileName);
+    if(!file)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string name;
+    float ms;
+    while(file >> name >> ms)
+    {
+        for(int i = 0; i < StageCount; i++)
+        {
+            if(name == stageNames[i])
+                m_msPerMPixel[i] = ms;
+        }
+    }
+    return true;
+}
+
+bool StageScheduler::save(const std::string &fileName) const
+{
+    std::ofstream file(fileName);
+    if(!file)
+        return false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(int i = 0; i < StageCount; i++)
+        file << stageNames[i] << " " << m_msPerMPixel[i] << std::endl;
+
+    return bool(file);
+}
+
+void StageScheduler::record(Stage stage, double ms, int w, int h)
+{
+    float mpx = float(w) * float(h) * 1e-6f;
+    if(mpx <= 0)
+        return;
+
+    float x = float(ms) / mpx;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    float &m = m_msPerMPixel[stage];
+    // Exponential moving average over earlier levels and frames
+    m = m > 0 ? 0.7f * m + 0.3f * x : x;
+}
+
+StageScheduler::Plan StageScheduler::plan(int w, int h) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(size_t i = 0; i < planCount; i++)
+    {
+        if(_cost(plans[i], w, h) <= m_budget)
+            return plans[i];
+    }
+    return plans[planCount - 1];
+}
+
+StageScheduler::Stage StageScheduler::denoiseStage(
+        ImageDenoiser::Quality quality)
+{
+    return quality == ImageDenoiser::Balanced ? DenoiseBalanced : DenoiseHigh;
+}
+
+float StageScheduler::_cost(const Plan &plan, int w, int h) const
+{
+    // Probes and OIDN estimates cost as much as a denoise of same quality
+    float ms = _denoiseCost(plan.denoiseQuality)
+            + plan.sureTries * _denoiseCost(plan.sureQuality)
+            + 2 * (plan.applyGB ? m_msPerMPixel[Blur]
+                                : _denoiseCost(plan.estimateQuality));
+    return ms * float(w) * float(h) * 1e-6f;
+}
+
+float StageScheduler::_denoiseCost(ImageDenoiser::Quality quality) const
+{
+    float high = m_msPerMPixel[DenoiseHigh];
+    float balanced = m_msPerMPixel[DenoiseBalanced];
+    // Unmeasured quality is extrapolated; with no timings at all only the
+    // cheapest plan is safe
+    if(high <= 0 && balanced <= 0)
+        return std::numeric_limits<float>::infinity();
+
+    if(quality == ImageDenoiser::High)
+        return high > 0 ? high : 2 * balanced;
+
+    return balanced > 0 ? balanced : 0.5f * high;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file threadpool.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#include "threadpool.h"
+#include <atomic>
+#include <algorithm>
+
+namespace {
+// Chunks start on 64-byte boundaries of float arrays
+const size_t lineFloats = 16;
+// Chunking depends only on the range, so reductions sum the same partials
+// in the same order whatever the thread count
+const size_t maxChunks = 256;
+}
+
+struct ThreadPool::Job
+{
+    const std::function<void(size_t, size_t)> *body;
+    size_t n;
+    size_t chunk;
+    size_t chunks;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+};
+
+ThreadPool *ThreadPool::m_instance = nullptr;
+
+ThreadPool::ThreadPool()
+{
+    _start(int(std::thread::hardware_concurrency()));
+}
+
+ThreadPool::~ThreadPool()
+{
+    _stop();
+}
+
+ThreadPool *ThreadPool::instance()
+{
+    static std::mutex instanceMutex;
+    std::lock_guard<std::mutex> lock(instanceMutex);
+    if(!m_instance)
+        m_instance = new ThreadPool();
+
+    return m_instance;
+}
+
+// 0 uses all hardware threads; call before any work is submitted
+void ThreadPool::setThreads(int numThreads)
+{
+    _stop();
+    _start(numThreads > 0 ? numThreads
+                          : int(std::thread::hardware_concurrency()));
+}
+
+int ThreadPool::threads() const
+{
+    return int(m_workers.size()) + 1;
+}
+
+// Calls body(begin, end) over chunks of [0, n). The caller works on its
+// own job too, so nested and concurrent calls cannot starve.
+void ThreadPool::parallelFor(size_t n,
+                             const std::function<void(size_t, size_t)> &body,
+                             size_t grain)
+{
+    if(n == 0)
+        return;
+
+    size_t chunk = std::max(std::max(grain, size_t(1)),
+                            (n + maxChunks - 1) / maxChunks);
+    chunk = (chunk + lineFloats - 1) / lineFloats * lineFloats;
+    size_t chunks = (n + chunk - 1) / chunk;
+    if(chunks == 1 || m_workers.empty())
+    {
+        for(size_t begin = 0; begin < n; begin += chunk)
+            body(begin, std::min(begin + chunk, n));
+        return;
+    }
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->body = &body;
+    job->n = n;
+    job->chunk = chunk;
+    job->chunks = chunks;
+    job->next = 0;
+    job->done = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(job);
+    }
+    m_wake.notify_all();
+    _runChunks(*job);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto it = std::find(m_jobs.begin(), m_jobs.end(), job);
+    if(it != m_jobs.end())
+        m_jobs.erase(it);
+    m_finished.wait(lock, [&job] { return job->done == job->chunks; });
+}
+
+// Sum of body(begin, end) over the same chunks as parallelFor, added in
+// chunk order so the result is deterministic
+double ThreadPool::parallelReduce(
+        size_t n, const std::function<double(size_t, size_t)> &body,
+        size_t grain)
+{
+    size_t chunk = std::max(std::max(grain, size_t(1)),
+                            (n + maxChunks - 1) / maxChunks);
+    chunk = (chunk + lineFloats - 1) / lineFloats * lineFloats;
+    std::vector<double> partial((n + chunk - 1) / chunk, 0.0);
+    parallelFor(n, [&](size_t begin, size_t end) {
+        partial[begin / chunk] = body(begin, end);
+    }, grain);
+
+    double sum = 0;
+    for(double p : partial)
+        sum += p;
+    return sum;
+}
+
+void ThreadPool::_start(int numThreads)
+{
+    m_stopping = false;
+    for(int i = 1; i < numThreads; i++)
+        m_workers.push_back(std::thread(&ThreadPool::_worker, this));
+}
+
+void ThreadPool::_stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+    for(std::thread &worker : m_workers)
+        worker.join();
+    m_workers.clear();
+}
+
+void ThreadPool::_worker()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(true)
+    {
+        m_wake.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+        if(m_stopping)
+            return;
+
+        std::shared_ptr<Job> job = m_jobs.front();
+        lock.unlock();
+        _runChunks(*job);
+        lock.lock();
+        // Every chunk is claimed: nothing left to hand out
+        if(!m_jobs.empty() && m_jobs.front() == job)
+            m_jobs.pop_front();
+    }
+}
+
+void ThreadPool::_runChunks(Job &job)
+{
+    while(true)
+    {
+        size_t i = job.next++;
+        if(i >= job.chunks)
+            return;
+
+        size_t begin = i * job.chunk;
+        (*job.body)(begin, std::min(begin + job.chunk, job.n));
+        if(++job.done == job.chunks)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_finished.notify_all();
+        }
+    }
+}
@@ -0,0 +1,260 @@
+/**
+ * @file tilesharder.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+#include "tilesharder.h"
+#include "imageloader.h"
+#include "bufferpool.h"
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <cstdlib>
+#include <cstdio>
+
+namespace {
+namespace fs = std::experimental::filesystem;
+
+// Buffers a frame is processed from
+bool isInput(const std::string &name)
+{
+    const char *exts[] = {"spp.hdr.exr", "spp.var.exr", "spp.alb.exr",
+                          "spp.nrm.exr"};
+    for(const char *ext : exts)
+    {
+        if(ImageLoader::endsWith(name, ext))
+            return true;
+    }
+    return false;
+}
+
+// Final products of a worker; its caches were computed on the crop and
+// only approximate the frame's, so they stay in the shard
+bool isProduct(const std::string &name)
+{
+    const char *exts[] = {"spp.weights.exr", "spp.slope.exr",
+                          "spp.intercept.exr", "spp.budget.exr",
+                          ".diff.exr"};
+    for(const char *ext : exts)
+    {
+        if(ImageLoader::endsWith(name, ext))
+            return true;
+    }
+    return ImageLoader::endsWith(name, ".exr")
+            && (name.find("spp.ours.") != std::string::npos
+                || name.find("spp.preview.") != std::string::npos);
+}
+
+// Blends are delivered; weights, curves and diffs are for inspection
+ImageLoader::ExrClass exrClass(const std::string &name)
+{
+    if(name.find(".diff.") != std::string::npos)
+        return ImageLoader::Debug;
+    if(name.find("spp.ours.") != std::string::npos
+            || name.find("spp.preview.") != std::string::npos)
+        return ImageLoader::Delivered;
+    if(ImageLoader::endsWith(name, "spp.weights.exr")
+            || ImageLoader::endsWith(name, "spp.slope.exr")
+            || ImageLoader::endsWith(name, "spp.intercept.exr"))
+        return ImageLoader::Debug;
+    return ImageLoader::Intermediate;
+}
+
+std::string quote(const std::string &arg)
+{
+    return "\"" + arg + "\"";
+}
+}
+
+TileSharder::TileSharder(const std::string &path, int tile, int halo)
+    : m_path(path), m_tile(tile), m_halo(halo), m_w(0), m_h(0)
+{
+}
+
+// Crops every input of the frame into one directory per tile, with a
+// halo so the denoiser and the blurs see context across the tile border
+bool TileSharder::split(std::ostream &out)
+{
+    m_inputs.clear();
+    for(const auto &entry : fs::directory_iterator(m_path))
+    {
+        std::string name = entry.path().filename().string();
+        if(entry.status().type() == fs::file_type::regular && isInput(name))
+            m_inputs.push_back(name);
+    }
+    if(m_inputs.empty())
+    {
+        out << "No HDR found!" << std::endl;
+        return false;
+    }
+    std::sort(m_inputs.begin(), m_inputs.end());
+
+    m_shards.clear();
+    for(size_t k = 0; k < m_inputs.size(); k++)
+    {
+        int w = 0, h = 0;
+        std::string inPath = m_path + "/" + m_inputs[k];
+        bool nonNegative = m_inputs[k].find("spp.var.") != std::string::npos;
+        std::vector<float> img = ImageLoader::loadImage(inPath, w, h,
+                                                        nonNegative);
+        if(img.empty())
+        {
+            out << "Error loading " << inPath << std::endl;
+            return false;
+        }
+        if(k == 0)
+        {
+            m_w = w;
+            m_h = h;
+            int tile = std::min(m_tile, std::max(w, h));
+            for(int y = 0; y < h; y += tile)
+            {
+                for(int x = 0; x < w; x += tile)
+                {
+                    Shard s;
+                    s.x = x;
+                    s.y = y;
+                    s.rw = std::min(tile, w - x);
+                    s.rh = std::min(tile, h - y);
+                    s.cx = std::max(x - m_halo, 0);
+                    s.cy = std::max(y - m_halo, 0);
+                    s.cw = std::min(x + s.rw + m_halo, w) - s.cx;
+                    s.ch = std::min(y + s.rh + m_halo, h) - s.cy;
+                    std::string n = std::to_string(m_shards.size());
+                    n.insert(0, 4 - std::min<size_t>(n.length(), 4), '0');
+                    s.dir = m_path + "/shards/tile_" + n;
+                    fs::create_directories(s.dir);
+                    m_shards.push_back(s);
+                }
+            }
+        }
+        else if(w != m_w || h != m_h)
+        {
+            out << inPath << " is " << w << "x" << h << ", expected "
+                << m_w << "x" << m_h << std::endl;
+            BufferPool::instance()->release(img);
+            return false;
+        }
+        for(const Shard &s : m_shards)
+        {
+            std::vector<float> crop = ImageLoader::crop(img, w, h, s.cx, s.cy,
+                                                        s.cw, s.ch);
+            ImageLoader::saveExr(crop, s.cw, s.ch, s.dir + "/" + m_inputs[k]);
+        }
+        BufferPool::instance()->release(img);
+    }
+    out << m_shards.size() << " shards of " << m_tile << "px, halo "
+        << m_halo << "px" << std::endl;
+    return true;
+}
+
+// Runs program on every shard directory in up to workers processes at
+// once; each worker's log goes to shard.log in its directory
+bool TileSharder::run(const std::string &program, const std::string &args,
+                      int workers, std::ostream &out)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    std::mutex outMutex;
+    std::vector<std::thread> threads;
+    size_t count = std::min(m_shards.size(), size_t(std::max(workers, 1)));
+    for(size_t t = 0; t < count; t++)
+    {
+        threads.push_back(std::thread([&]() {
+            size_t k;
+            while((k = next++) < m_shards.size())
+            {
+                const std::string &dir = m_shards[k].dir;
+                std::string cmd = quote(program) + " " + quote(dir) + args
+                        + " > " + quote(dir + "/shard.log") + " 2>&1";
+#ifdef _WIN32
+                // cmd.exe strips the outer quotes of the whole line
+                cmd = "\"" + cmd + "\"";
+#endif
+                int r = std::system(cmd.c_str());
+                std::lock_guard<std::mutex> lock(outMutex);
+                if(r != 0)
+                {
+                    out << "Shard " << dir << " failed (" << r
+                        << "), see shard.log" << std::endl;
+                    ok = false;
+                }
+            }
+        }));
+    }
+    for(std::thread &thread : threads)
+        thread.join();
+
+    return ok;
+}
+
+// Pastes the core of one output of every shard into a frame-sized image;
+// empty if a shard lacks it or it is not per pixel (block curves). With
+// consume the shards' copies are removed, so stitch skips them
+std::vector<float> TileSharder::gather(const std::string &name, bool consume)
+{
+    std::vector<float> frame = BufferPool::instance()->acquire(
+                3 * size_t(m_w) * size_t(m_h), "stitch");
+    for(const Shard &s : m_shards)
+    {
+        int w = 0, h = 0;
+        std::string partPath = s.dir + "/" + name;
+        std::vector<float> part = ImageLoader::loadImage(partPath, w, h);
+        if(part.empty() || w != s.cw || h != s.ch)
+        {
+            BufferPool::instance()->release({&part, &frame});
+            return frame;
+        }
+        ImageLoader::paste(part, s.cw, s.x - s.cx, s.y - s.cy, frame, m_w,
+                           s.x, s.y, s.rw, s.rh);
+        BufferPool::instance()->release(part);
+        if(consume)
+            std::remove(partPath.c_str());
+    }
+    return frame;
+}
+
+// Pastes the core of every shard's final products back into frame-sized
+// images next to the inputs; returns the names of the stitched files
+std::vector<std::string> TileSharder::stitch(std::ostream &out)
+{
+    std::vector<std::string> names;
+    if(m_shards.empty())
+        return names;
+
+    for(const auto &entry : fs::directory_iterator(m_shards[0].dir))
+    {
+        std::string name = entry.path().filename().string();
+        if(entry.status().type() == fs::file_type::regular
+                && isProduct(name))
+            names.push_back(name);
+    }
+    std::sort(names.begin(), names.end());
+
+    std::vector<std::string> stitched;
+    for(const std::string &name : names)
+    {
+        std::vector<float> frame = gather(name, false);
+        if(!frame.empty())
+        {
+            ImageLoader::saveExr(frame, m_w, m_h, m_path + "/" + name,
+                                 exrClass(name));
+            stitched.push_back(name);
+        }
+        else
+            out << "Not stitched: " << name << std::endl;
+
+        BufferPool::instance()->release(frame);
+    }
+    return stitched;
+}
+
+// Sorted, so the last HDR is the reference
+const std::vector<std::string> &TileSharder::inputs() const
+{
+    return m_inputs;
+}
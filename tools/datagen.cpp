@@ -0,0 +1,291 @@
+/**
+ * @file datagen.cpp
+ * @author E. Denisova
+ * @date 29/2/2024
+ * @version 1.0
+**/
+
+// Writes a synthetic progressive render sequence in the layout MCPTBlender
+// reads: name_NNNNNNspp.{hdr,var,alb,nrm}.exr for every level of the spp
+// ladder plus the reference at the highest spp. Images are produced in
+// strips of rows, so memory stays flat from 256^2 up to 16K.
+#define IMATH_DLL
+
+#include <ImfRgbaFile.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+namespace {
+const float pi = 3.14159265f;
+const int stripRows = 16;
+
+struct Options
+{
+    std::string dir;
+    std::string name = "synthetic";
+    int w = 256;
+    int h = 256;
+    std::vector<int> ladder = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+    int refSpp = 65536;
+    // Variance of the mean falls as n^-alpha; 1 is plain Monte Carlo
+    float alpha = 1.0f;
+    // Per-sample noise standard deviation relative to the radiance
+    float noise = 0.5f;
+    uint32_t seed = 1;
+};
+
+// Counter-based hash, so any pixel of any level can be drawn independently
+inline uint32_t hash(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    uint32_t x = a * 0x9E3779B1u ^ b * 0x85EBCA77u ^ c * 0xC2B2AE3Du
+            ^ d * 0x27D4EB2Fu;
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Standard normal by Box-Muller from two hashed uniforms
+inline float gauss(size_t p, int level, int c, uint32_t seed)
+{
+    uint32_t k = uint32_t(p) ^ uint32_t(p >> 32) * 0x632BE5ABu;
+    float u1 = (float(hash(k, uint32_t(level), uint32_t(2 * c), seed) >> 8)
+                + 0.5f) / 16777216.0f;
+    float u2 = float(hash(k, uint32_t(level), uint32_t(2 * c + 1), seed) >> 8)
+            / 16777216.0f;
+    return std::sqrt(-2.0f * std::log(u1)) * std::cos(2 * pi * u2);
+}
+
+// Procedural scene: checker and discs of albedo over a bumpy surface lit
+// by one directional light, with a few HDR highlights
+void scene(float u, float v, float *albedo, float *normal, float *radiance)
+{
+    bool checker = (int(u * 8) + int(v * 8)) % 2 == 0;
+    float du = u - 0.5f, dv = v - 0.5f;
+    bool disc = du * du + dv * dv < 0.09f;
+    albedo[0] = disc ? 0.8f : checker ? 0.7f * u + 0.1f : 0.2f;
+    albedo[1] = disc ? 0.3f : checker ? 0.7f * v + 0.1f : 0.25f;
+    albedo[2] = disc ? 0.1f : checker ? 0.6f : 0.3f;
+
+    // Height 0.05 sin(12 pi u) sin(8 pi v)
+    float hu = 0.05f * 12 * pi * std::cos(12 * pi * u) * std::sin(8 * pi * v);
+    float hv = 0.05f * 8 * pi * std::sin(12 * pi * u) * std::cos(8 * pi * v);
+    float len = std::sqrt(hu * hu + hv * hv + 1);
+    normal[0] = -hu / len;
+    normal[1] = -hv / len;
+    normal[2] = 1 / len;
+
+    const float light[3] = {0.32f, 0.48f, 0.82f};
+    float cosine = std::max(normal[0] * light[0] + normal[1] * light[1]
+                            + normal[2] * light[2], 0.0f);
+    float shade = 2 * cosine + 0.1f;
+    // Highlights where the surface faces the light
+    if(cosine > 0.995f)
+        shade += 20;
+    for(int c = 0; c < 3; c++)
+        radiance[c] = albedo[c] * shade;
+}
+
+std::string levelPath(const Options &opt, int spp, const std::string &ext)
+{
+    std::string sppStr = std::to_string(spp);
+    sppStr.insert(0, 6 - std::min<size_t>(sppStr.length(), 6), '0');
+    return opt.dir + "/" + opt.name + "_" + sppStr + "spp." + ext + ".exr";
+}
+
+// One output file per level and buffer, fed one strip at a time
+struct Writer
+{
+    Writer(const std::string &path, int w, int h)
+        : file(path.c_str(), w, h, Imf::WRITE_RGB),
+          pixels(size_t(w) * stripRows)
+    {
+    }
+
+    void write(int y0, int rows, int w)
+    {
+        file.setFrameBuffer(pixels.data() - y0 * w, 1, size_t(w));
+        file.writePixels(rows);
+    }
+
+    Imf::RgbaOutputFile file;
+    std::vector<Imf::Rgba> pixels;
+};
+
+bool parseLadder(const std::string &arg, std::vector<int> &ladder)
+{
+    ladder.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while(std::getline(ss, item, ','))
+    {
+        int n = std::atoi(item.c_str());
+        if(n < 1)
+            return false;
+
+        ladder.push_back(n);
+    }
+    std::sort(ladder.begin(), ladder.end());
+    ladder.erase(std::unique(ladder.begin(), ladder.end()), ladder.end());
+    return !ladder.empty();
+}
+
+int generate(const Options &opt)
+{
+    // The reference is the last level; MCPTBlender treats it as one too
+    std::vector<int> levels = opt.ladder;
+    levels.push_back(opt.refSpp);
+    size_t count = levels.size();
+    std::vector<std::unique_ptr<Writer>> hdr, var, alb, nrm;
+    for(int spp : levels)
+    {
+        hdr.emplace_back(new Writer(levelPath(opt, spp, "hdr"), opt.w, opt.h));
+        var.emplace_back(new Writer(levelPath(opt, spp, "var"), opt.w, opt.h));
+        alb.emplace_back(new Writer(levelPath(opt, spp, "alb"), opt.w, opt.h));
+        nrm.emplace_back(new Writer(levelPath(opt, spp, "nrm"), opt.w, opt.h));
+    }
+
+    // Running sum of unit normals per pixel and channel: the estimate at
+    // n spp shares the samples of every lower level, like a real render
+    std::vector<float> walk(3 * size_t(opt.w) * stripRows);
+    for(int y0 = 0; y0 < opt.h; y0 += stripRows)
+    {
+        int rows = std::min(stripRows, opt.h - y0);
+        std::fill(walk.begin(), walk.end(), 0.0f);
+        for(int y = y0; y < y0 + rows; y++)
+        {
+            for(int x = 0; x < opt.w; x++)
+            {
+                size_t p = size_t(x) + size_t(y) * size_t(opt.w);
+                size_t s = size_t(x) + size_t(y - y0) * size_t(opt.w);
+                float albedo[3], normal[3], radiance[3];
+                scene((x + 0.5f) / opt.w, (y + 0.5f) / opt.h, albedo, normal,
+                      radiance);
+                int prevSpp = 0;
+                for(size_t l = 0; l < count; l++)
+                {
+                    int n = levels[l];
+                    float rgb[3], v[3];
+                    for(int c = 0; c < 3; c++)
+                    {
+                        float &sum = walk[3 * s + size_t(c)];
+                        sum += std::sqrt(float(n - prevSpp))
+                                * gauss(p, int(l), c, opt.seed);
+                        float sigma = opt.noise * (radiance[c] + 0.05f);
+                        float scale = sigma
+                                * std::pow(float(n), -0.5f * opt.alpha);
+                        bool ref = l + 1 == count;
+                        rgb[c] = ref ? radiance[c]
+                                     : std::max(radiance[c]
+                                                + scale * sum
+                                                / std::sqrt(float(n)), 0.0f);
+                        // Sample variance is itself noisy at low spp
+                        float spread = n > 1 ? std::sqrt(2.0f / (n - 1)) : 1;
+                        v[c] = scale * scale
+                                * std::max(1 + spread
+                                           * gauss(p, int(l), c + 3,
+                                                   opt.seed), 0.0f);
+                    }
+                    hdr[l]->pixels[s] = Imf::Rgba(rgb[0], rgb[1], rgb[2]);
+                    var[l]->pixels[s] = Imf::Rgba(v[0], v[1], v[2]);
+                    alb[l]->pixels[s] = Imf::Rgba(albedo[0], albedo[1],
+                                                  albedo[2]);
+                    nrm[l]->pixels[s] = Imf::Rgba(normal[0], normal[1],
+                                                  normal[2]);
+                    prevSpp = n;
+                }
+            }
+        }
+        for(size_t l = 0; l < count; l++)
+        {
+            hdr[l]->write(y0, rows, opt.w);
+            var[l]->write(y0, rows, opt.w);
+            alb[l]->write(y0, rows, opt.w);
+            nrm[l]->write(y0, rows, opt.w);
+        }
+    }
+    return 0;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    Options opt;
+    if(argc < 2)
+    {
+        std::cout << "Usage: MCPTDataGen <output directory> [options]"
+                  << std::endl;
+        std::cout << "   -n NAME     file name prefix (default synthetic)"
+                  << std::endl;
+        std::cout << "   -r W H      resolution (default 256 256)"
+                  << std::endl;
+        std::cout << "   -l LIST     comma-separated spp ladder "
+                     "(default 1,2,4,...,1024)" << std::endl;
+        std::cout << "   -R SPP      reference spp (default 65536)"
+                  << std::endl;
+        std::cout << "   -a ALPHA    variance falls as spp^-ALPHA (default 1)"
+                  << std::endl;
+        std::cout << "   -k K        per-sample noise relative to radiance "
+                     "(default 0.5)" << std::endl;
+        std::cout << "   -S SEED     random seed (default 1)" << std::endl;
+        return 0;
+    }
+    opt.dir = argv[1];
+    for(int i = 2; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if(arg == "-n" && i + 1 < argc)
+            opt.name = argv[++i];
+        else if(arg == "-r" && i + 2 < argc)
+        {
+            opt.w = std::atoi(argv[++i]);
+            opt.h = std::atoi(argv[++i]);
+        }
+        else if(arg == "-l" && i + 1 < argc)
+        {
+            if(!parseLadder(argv[++i], opt.ladder))
+            {
+                std::cerr << "Invalid spp ladder" << std::endl;
+                return -1;
+            }
+        }
+        else if(arg == "-R" && i + 1 < argc)
+            opt.refSpp = std::atoi(argv[++i]);
+        else if(arg == "-a" && i + 1 < argc)
+            opt.alpha = float(std::atof(argv[++i]));
+        else if(arg == "-k" && i + 1 < argc)
+            opt.noise = float(std::atof(argv[++i]));
+        else if(arg == "-S" && i + 1 < argc)
+            opt.seed = uint32_t(std::atoi(argv[++i]));
+        else
+        {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return -1;
+        }
+    }
+    if(opt.w < 1 || opt.h < 1 || opt.refSpp <= opt.ladder.back()
+            || opt.refSpp > 999999)
+    {
+        std::cerr << "Resolution must be positive and the reference spp "
+                     "above the ladder (at most 999999)" << std::endl;
+        return -1;
+    }
+    try {
+        return generate(opt);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error writing " << opt.dir << ": " << e.what()
+                  << std::endl;
+        return -1;
+    }
+}